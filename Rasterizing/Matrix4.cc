@@ -1,5 +1,11 @@
 #include "Matrix4.h"
 
+#include <cstring> // strcmp for batch_kernel(name)
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSE and AVX (only used inside functions marked for them, picked at runtime)
+#define MATRIX4_X86
+#endif
+
 
 // Constants
 static const float TO_RADIANS = std::acos(-1) / 180.0f; // Used in rotation
@@ -190,6 +196,147 @@ void Matrix4::multiply_mutate(Point4& p) {
     const float W = wx*p.x + wy*p.y + wz*p.z + ww*p.w;
     p.x = X; p.y = Y; p.z = Z; p.w = W;
 }
+// Batch Matrix * Points
+// Every kernel does the 4 rows in the same order as multiply_mutate(Point4&) (no fused multiply adds), so the results are bit for bit the same.
+namespace {
+struct batch_input {
+    const float* aos; int components, stride; // Points one after another (aos is nullptr if not)
+    const float* x; const float* y; const float* z; const float* w; // Or split into arrays (w is nullptr for all 1's)
+};
+struct batch_output { float* x; float* y; float* z; float* w; };
+typedef void (*batch_function)(const Matrix4& m, const batch_input& in, int first, int last, const batch_output& out);
+
+inline float batch_load(const batch_input& in, int c, int i) {
+    if (in.aos) return c < in.components ? in.aos[i*in.stride + c] : 1.0f;
+    const float* a = c == 0 ? in.x : c == 1 ? in.y : c == 2 ? in.z : in.w;
+    return a ? a[i] : 1.0f;
+}
+
+// Plain floats (any CPU, and the leftovers of the others)
+void batch_scalar(const Matrix4& m, const batch_input& in, int first, int last, const batch_output& out) {
+    for (int i = first; i < last; i++) {
+        const float x = batch_load(in, 0, i), y = batch_load(in, 1, i), z = batch_load(in, 2, i), w = batch_load(in, 3, i);
+        out.x[i] = m.xx*x + m.xy*y + m.xz*z + m.xw*w;
+        out.y[i] = m.yx*x + m.yy*y + m.yz*z + m.yw*w;
+        out.z[i] = m.zx*x + m.zy*y + m.zz*z + m.zw*w;
+        out.w[i] = m.wx*x + m.wy*y + m.wz*z + m.ww*w;
+    }
+}
+
+#ifdef MATRIX4_X86
+// SSE, 4 points at a time
+__attribute__((target("sse2"))) inline __m128 batch_load_sse(const batch_input& in, int c, int i) {
+    if (in.aos) {
+        if (c >= in.components) return _mm_set1_ps(1.0f);
+        const float* p = in.aos + i*in.stride + c;
+        const int S = in.stride;
+        return _mm_set_ps(p[3*S], p[2*S], p[S], p[0]);
+    }
+    const float* a = c == 0 ? in.x : c == 1 ? in.y : c == 2 ? in.z : in.w;
+    return a ? _mm_loadu_ps(a + i) : _mm_set1_ps(1.0f);
+}
+__attribute__((target("sse2"))) inline __m128 batch_row_sse(float a, float b, float c, float d, __m128 x, __m128 y, __m128 z, __m128 w) {
+    __m128 r = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a), x), _mm_mul_ps(_mm_set1_ps(b), y));
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(c), z));
+    return _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(d), w));
+}
+__attribute__((target("sse2"))) void batch_sse(const Matrix4& m, const batch_input& in, int first, int last, const batch_output& out) {
+    int i = first;
+    for (; i + 4 <= last; i += 4) {
+        const __m128 x = batch_load_sse(in, 0, i), y = batch_load_sse(in, 1, i), z = batch_load_sse(in, 2, i), w = batch_load_sse(in, 3, i);
+        _mm_storeu_ps(out.x + i, batch_row_sse(m.xx, m.xy, m.xz, m.xw, x, y, z, w));
+        _mm_storeu_ps(out.y + i, batch_row_sse(m.yx, m.yy, m.yz, m.yw, x, y, z, w));
+        _mm_storeu_ps(out.z + i, batch_row_sse(m.zx, m.zy, m.zz, m.zw, x, y, z, w));
+        _mm_storeu_ps(out.w + i, batch_row_sse(m.wx, m.wy, m.wz, m.ww, x, y, z, w));
+    }
+    batch_scalar(m, in, i, last, out);
+}
+
+// AVX, 8 points at a time
+__attribute__((target("avx"))) inline __m256 batch_load_avx(const batch_input& in, int c, int i) {
+    if (in.aos) {
+        if (c >= in.components) return _mm256_set1_ps(1.0f);
+        const float* p = in.aos + i*in.stride + c;
+        const int S = in.stride;
+        return _mm256_set_ps(p[7*S], p[6*S], p[5*S], p[4*S], p[3*S], p[2*S], p[S], p[0]);
+    }
+    const float* a = c == 0 ? in.x : c == 1 ? in.y : c == 2 ? in.z : in.w;
+    return a ? _mm256_loadu_ps(a + i) : _mm256_set1_ps(1.0f);
+}
+__attribute__((target("avx"))) inline __m256 batch_row_avx(float a, float b, float c, float d, __m256 x, __m256 y, __m256 z, __m256 w) {
+    __m256 r = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(a), x), _mm256_mul_ps(_mm256_set1_ps(b), y));
+    r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_set1_ps(c), z));
+    return _mm256_add_ps(r, _mm256_mul_ps(_mm256_set1_ps(d), w));
+}
+__attribute__((target("avx"))) void batch_avx(const Matrix4& m, const batch_input& in, int first, int last, const batch_output& out) {
+    int i = first;
+    for (; i + 8 <= last; i += 8) {
+        const __m256 x = batch_load_avx(in, 0, i), y = batch_load_avx(in, 1, i), z = batch_load_avx(in, 2, i), w = batch_load_avx(in, 3, i);
+        _mm256_storeu_ps(out.x + i, batch_row_avx(m.xx, m.xy, m.xz, m.xw, x, y, z, w));
+        _mm256_storeu_ps(out.y + i, batch_row_avx(m.yx, m.yy, m.yz, m.yw, x, y, z, w));
+        _mm256_storeu_ps(out.z + i, batch_row_avx(m.zx, m.zy, m.zz, m.zw, x, y, z, w));
+        _mm256_storeu_ps(out.w + i, batch_row_avx(m.wx, m.wy, m.wz, m.ww, x, y, z, w));
+    }
+    batch_sse(m, in, i, last, out);
+}
+#endif
+
+// The kernels, best first
+struct batch_choice { const char* name; batch_function function; };
+const batch_choice BATCH_KERNELS[] = {
+#ifdef MATRIX4_X86
+    {"avx", batch_avx},
+    {"sse", batch_sse},
+#endif
+    {"scalar", batch_scalar},
+};
+
+bool batch_supported(const batch_choice& k) {
+#ifdef MATRIX4_X86
+    if (k.function == batch_avx) return __builtin_cpu_supports("avx");
+    if (k.function == batch_sse) return __builtin_cpu_supports("sse2");
+#endif
+    return true;
+}
+
+// Picked once, the first time it's needed
+const batch_choice*& batch_selected() {
+    static const batch_choice* selected = nullptr;
+    if (!selected) {
+        for (const batch_choice& k : BATCH_KERNELS) {
+            if (batch_supported(k)) {
+                selected = &k;
+                break;
+            }
+        }
+    }
+    return selected;
+}
+}
+
+void Matrix4::multiply_batch(const float* in, int count, int components, int stride,
+                             float* out_x, float* out_y, float* out_z, float* out_w) const {
+    const batch_input IN = {in, components, stride, nullptr, nullptr, nullptr, nullptr};
+    batch_selected()->function(*this, IN, 0, count, {out_x, out_y, out_z, out_w});
+}
+void Matrix4::multiply_batch(const float* in_x, const float* in_y, const float* in_z, const float* in_w, int count,
+                             float* out_x, float* out_y, float* out_z, float* out_w) const {
+    const batch_input IN = {nullptr, 4, 0, in_x, in_y, in_z, in_w};
+    batch_selected()->function(*this, IN, 0, count, {out_x, out_y, out_z, out_w});
+}
+const char* Matrix4::batch_kernel() {
+    return batch_selected()->name;
+}
+bool Matrix4::batch_kernel(const char* name) {
+    for (const batch_choice& k : BATCH_KERNELS) {
+        if (std::strcmp(k.name, name) == 0 && batch_supported(k)) {
+            batch_selected() = &k;
+            return true;
+        }
+    }
+    return false;
+}
+
 // Multiply Matrix * Vector (With homogenious converion)
 // [xx_x + xy_y + xz_z + xw] = [xx xy xz xw] * [x]
 // [yx_x + yy_y + yz_z + yw] = [yx yy yz yw] * [y]
@@ -878,9 +1025,18 @@ Matrix4 Matrix4::world_to_camera(float eyeX, float eyeY, float eyeZ, float atX,
 // [       0      , 1/(2tan(o/2)),   1/2  ,     0    ] = [ 0 , 1/2, 0, 1/2] * [       0      , 1/tan(o/2),    0   ,     0    ]
 // [       0      ,       0      , f/(f-n), -fn/(f-n)] = [ 0 ,  0 , 1,  0 ] * [       0      ,     0     , f/(f-n), -fn/(f-n)]
 // [       0      ,       0      ,    1   ,     0    ] = [ 0 ,  0 , 0,  1 ] * [       0      ,     0     ,    1   ,     0    ]
-Matrix4 Matrix4::camera_to_clip(float fov, float near, float far, float aspect) {
+Matrix4 Matrix4::camera_to_clip(float fov, float near, float far, float aspect, bool reversed) {
     const float TAN2 = std::tan(fov * TO_RADIANS_2) * 2;
     const float F_FN = far / (far - near);
+    if (reversed) { // z is w minus the z below, worked out here so the far depths don't lose their precision to 1 - z/w later
+        const float N_FN = near / (far - near);
+        return Matrix4(
+            (float)1.0f/(aspect*TAN2),        0        , 0.5f,     0    ,
+                        0            , (float)1.0f/TAN2, 0.5f,     0    ,
+                        0            ,        0        , -N_FN, far*N_FN,
+                        0            ,        0        ,  1   ,     0
+        );
+    }
     return Matrix4(
         (float)1.0f/(aspect*TAN2),        0        , 0.5f,     0     ,
                     0            , (float)1.0f/TAN2, 0.5f,     0     ,
@@ -915,4 +1071,22 @@ Matrix4 Matrix4::clip_to_device(int width, int height) {
     );
     //).translate(.25,.25,0).scale(.5,.5,1); // Shortens the viewport to help debug clipping
     //).translate(.125,.125,0).scale(.75,.75,1); // 3/4
+}
+
+// Inverse transpose of the 3x3 = cofactors / determinant
+// [xx xy xz]      [yy*zz-yz*zy  yz*zx-yx*zz  yx*zy-yy*zx]
+// [yx yy yz]  ->  [xz*zy-xy*zz  xx*zz-xz*zx  xy*zx-xx*zy] / det
+// [zx zy zz]      [xy*yz-xz*yy  xz*yx-xx*yz  xx*yy-xy*yx]
+Matrix4 Matrix4::normal_matrix() const {
+    const float CXX = yy*zz - yz*zy, CXY = yz*zx - yx*zz, CXZ = yx*zy - yy*zx;
+    const float DET = xx*CXX + xy*CXY + xz*CXZ;
+    if (DET == 0) return Matrix4();
+
+    const float INV = 1.0f / DET;
+    return Matrix4(
+        CXX*INV,             CXY*INV,             CXZ*INV,             0,
+        (xz*zy - xy*zz)*INV, (xx*zz - xz*zx)*INV, (xy*zx - xx*zy)*INV, 0,
+        (xy*yz - xz*yy)*INV, (xz*yx - xx*yz)*INV, (xx*yy - xy*yx)*INV, 0,
+        0,                   0,                   0,                   1
+    );
 }
\ No newline at end of file
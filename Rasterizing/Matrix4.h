@@ -61,6 +61,16 @@ struct Matrix4 {
     void multiply_mutate(Vector3& v);                  // [ 1 ] = [wx wy wz ww] * [1]
     // Note: This takes a bit longer as the returning Vector3 needs to be converted to homogenous coordinates
 
+    // Batch Matrix * Points (Structure of Arrays out)                                   // out_x[i] = [xx xy xz xw] * [x]
+    // Point i starts at in[i*stride] as xyz (components is 3, w is 1) or xyzw (components is 4) // out_y[i] = [yx yy yz yw] * [y]
+    // Gives the exact same numbers as multiply_mutate(Point4&) one point at a time         // out_z[i] = [zx zy zz zw] * [z]
+    void multiply_batch(const float* in, int count, int components, int stride,          // out_w[i] = [wx wy wz ww] * [w]
+                        float* out_x, float* out_y, float* out_z, float* out_w) const;
+    void multiply_batch(const float* in_x, const float* in_y, const float* in_z, const float* in_w, int count, // Same but already split into arrays (in_w can be nullptr for all 1's)
+                        float* out_x, float* out_y, float* out_z, float* out_w) const;
+    static const char* batch_kernel();          // Which kernel multiply_batch uses, picked at runtime for this CPU ("avx", "sse" or "scalar")
+    static bool batch_kernel(const char* name); // Forces one of them (false if this CPU can't run it), mostly for benchmarking
+
 
     // Translation
     Matrix4 translate(float x, float y, float z) const; // Translates this matrix by (x y z), with the transformation matrix on the right side like so
@@ -157,12 +167,18 @@ struct Matrix4 {
     // Near and far are z distances of the near and far clipping planes respectively. 
     // Aspect is the ratio of horizontal to vertical size of the display device. 
     // This routine assumes that the viewing window is centered about the optical axis of the camera.
-    static Matrix4 camera_to_clip(float fov, float near, float far, float aspect);
+    // If reversed, z goes the other way (1 at the near plane, 0 at the far plane) for a reversed-Z depth buffer.
+    static Matrix4 camera_to_clip(float fov, float near, float far, float aspect, bool reversed = false);
 
     // Returns a transformation to go from normalized clipping coordinates to device coordinates.
     // Width and height are the size (in pixels) of the final viewing device.
     static Matrix4 clip_to_device(int width, int height);
 
+    // Returns the transformation for normals of surfaces transformed by this matrix (so they stay perpendicular under non-uniform scale),
+    // which is the inverse transpose of the upper left 3x3 (translation doesn't move normals), the rest is identity.
+    // The results still need to be normalized. Identity if the 3x3 can't be inverted.
+    Matrix4 normal_matrix() const;
+
 
     // Operators
     friend Vector3 operator * (const Matrix4& m,  const Vector3& v)  { return m.multiply(v);               }; // Vector3 = Matrix * Vector3
@@ -0,0 +1,176 @@
+#ifndef DEPTH_BUFFER_H
+#define DEPTH_BUFFER_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+
+// Depth buffer formats (OptionString "DepthFormat", takes effect at the next WorldBegin)
+//   "float"    32 bit float, 0 is close and 1 is far (default)
+//   "reversed" 32 bit float reversed-Z. camera_to_clip maps the near plane to 1 and the far plane to 0 and the buffer is cleared to 0,
+//              so the far end (where perspective squeezes depths together) lands next to 0 where floats are the most precise.
+//              Closer is bigger, so every depth test is greater-or-equal (see passes() and in_front()).
+//   "unorm24"  24 bit fixed point from 0 to 1, 3 bytes a pixel
+//   "unorm16"  16 bit fixed point, half of the memory of float (only for scenes whose depth range fits in 65536 steps)
+//   "minmax"   32 bit float plus the closest and farthest depth of every DEPTH_BLOCK x DEPTH_BLOCK block (per-tile min/max compression).
+//              Clearing only resets the blocks (a block's pixels aren't touched until the first write into it),
+//              and a test that the block's bounds already decide never reads the pixel (see read(i, z, reads)).
+// Fragments quantize() their depth first (so it's exactly what write() would keep), then compare it to the stored depth with passes().
+enum depth_format { DEPTH_FLOAT, DEPTH_REVERSED, DEPTH_UNORM24, DEPTH_UNORM16, DEPTH_MINMAX };
+
+#define DEPTH_UNORM24_MAX 16777215.0f // 2^24 - 1
+#define DEPTH_UNORM16_MAX 65535.0f    // 2^16 - 1
+#define DEPTH_BLOCK 8 // Pixels across a "minmax" block (a tile holds whole blocks, so tile workers never share one)
+
+class DepthBuffer {
+public:
+    depth_format format = DEPTH_FLOAT;
+
+    // Name to format, false if there's no such format
+    static bool parse(const std::string& name, depth_format& format) {
+        if      (name == "float")    format = DEPTH_FLOAT;
+        else if (name == "reversed") format = DEPTH_REVERSED;
+        else if (name == "unorm24")  format = DEPTH_UNORM24;
+        else if (name == "unorm16")  format = DEPTH_UNORM16;
+        else if (name == "minmax")   format = DEPTH_MINMAX;
+        else return false;
+        return true;
+    }
+    const char* name() const {
+        const char* NAMES[] = {"float", "reversed", "unorm24", "unorm16", "minmax"};
+        return NAMES[format];
+    }
+    int bytes_per_pixel() const { return format == DEPTH_UNORM16 ? 2 : format == DEPTH_UNORM24 ? 3 : 4; }
+
+    bool reversed() const { return format == DEPTH_REVERSED; }
+    float farthest() const { return reversed() ? 0.0f : 1.0f; } // What the buffer is cleared to
+    float closest() const { return reversed() ? 1.0f : 0.0f; }
+    bool exact() const { return format == DEPTH_FLOAT || format == DEPTH_REVERSED || format == DEPTH_MINMAX; } // quantize() doesn't change anything
+
+    // The depth test, z is as close as depth or closer (less-or-equal, greater-or-equal when reversed)
+    bool passes(float z, float depth) const { return reversed() ? z >= depth : z <= depth; }
+    // a is strictly closer than b
+    bool in_front(float a, float b) const { return reversed() ? a > b : a < b; }
+    float closer(float a, float b) const { return in_front(a, b) ? a : b; }
+    float farther(float a, float b) const { return in_front(a, b) ? b : a; }
+
+    // Sets every pixel to the farthest depth (keeps the memory from the last frame if it's the same size)
+    void reset(depth_format new_format, int new_width, int new_height) {
+        format = new_format;
+        width = new_width; height = new_height;
+        const int SIZE = new_width*new_height;
+        floats.clear(); unorm16.clear(); unorm24.clear(); blocks.clear();
+        switch (format) {
+        case DEPTH_FLOAT:
+        case DEPTH_REVERSED: floats.assign(SIZE, farthest()); break;
+        case DEPTH_UNORM24:  unorm24.assign(SIZE*3, 0xFF);    break;
+        case DEPTH_UNORM16:  unorm16.assign(SIZE, 0xFFFF);    break;
+        case DEPTH_MINMAX:
+            floats.resize(SIZE); // Left as is, every block starts out cleared
+            blocks_x = (new_width + DEPTH_BLOCK - 1) / DEPTH_BLOCK;
+            blocks.assign(blocks_x * ((new_height + DEPTH_BLOCK - 1) / DEPTH_BLOCK), {farthest(), farthest(), true});
+            break;
+        }
+    }
+    void clear() { floats.clear(); unorm16.clear(); unorm24.clear(); blocks.clear(); }
+
+    // The depth z would be kept as
+    float quantize(float z) const {
+        switch (format) {
+        case DEPTH_UNORM24: return encode(z, DEPTH_UNORM24_MAX) / DEPTH_UNORM24_MAX;
+        case DEPTH_UNORM16: return encode(z, DEPTH_UNORM16_MAX) / DEPTH_UNORM16_MAX;
+        default:            return z;
+        }
+    }
+
+    float read(int i) const {
+        switch (format) {
+        case DEPTH_UNORM24: {
+            const unsigned char* d = &unorm24[i*3];
+            return (d[0] | d[1] << 8 | d[2] << 16) / DEPTH_UNORM24_MAX;
+        }
+        case DEPTH_UNORM16: return unorm16[i] / DEPTH_UNORM16_MAX;
+        case DEPTH_MINMAX: {
+            const depth_block& b = blocks[block_of(i)];
+            return b.cleared ? b.min : floats[i];
+        }
+        default:            return floats[i];
+        }
+    }
+
+    // What to test z against at pixel i (adds the pixels it had to read to reads).
+    // For "minmax" it's the block's min or max when that already tells how z compares to the pixel (and is equal only if the pixel is),
+    // so the pixel itself is only read when z is between them. The other formats always read the pixel.
+    // (max only ever moves out, pulling it back in means reading the whole block, which cost more reads than it saved on the Input scenes)
+    float read(int i, float z, long& reads) {
+        if (format != DEPTH_MINMAX) {
+            reads++;
+            return read(i);
+        }
+        depth_block& b = blocks[block_of(i)];
+        if (b.cleared || z < b.min) return b.min; // Every pixel is the clear depth, or z is in front of all of them
+        if (z > b.max || b.min == b.max) return b.max; // z is behind all of them, or they're all the same
+        reads++;
+        return floats[i];
+    }
+
+    void write(int i, float z) {
+        switch (format) {
+        case DEPTH_UNORM24: {
+            const uint32_t CODE = encode(z, DEPTH_UNORM24_MAX);
+            unsigned char* d = &unorm24[i*3];
+            d[0] = CODE; d[1] = CODE >> 8; d[2] = CODE >> 16;
+            break;
+        }
+        case DEPTH_UNORM16: unorm16[i] = encode(z, DEPTH_UNORM16_MAX); break;
+        case DEPTH_MINMAX: {
+            depth_block& b = blocks[block_of(i)];
+            if (b.cleared) { // First write since the clear, now the pixels have to hold something
+                for_block_pixels(i, [&](int p) { floats[p] = b.min; });
+                b.cleared = false;
+            }
+            floats[i] = z;
+            if (z < b.min) b.min = z;
+            if (z > b.max) b.max = z;
+            break;
+        }
+        default:            floats[i] = z;
+        }
+    }
+
+private:
+    // A "minmax" block, min <= every pixel in it <= max
+    struct depth_block {
+        float min, max;
+        bool cleared; // The pixels were never written since reset(), they're all min (and max)
+    };
+
+    std::vector<float> floats;           // DEPTH_FLOAT, DEPTH_REVERSED and DEPTH_MINMAX
+    std::vector<uint16_t> unorm16;       // DEPTH_UNORM16
+    std::vector<unsigned char> unorm24;  // DEPTH_UNORM24, little endian 3 bytes a pixel
+    std::vector<depth_block> blocks;     // DEPTH_MINMAX
+    int width = 0, height = 0, blocks_x = 0;
+
+    int block_of(int i) const {
+        const int Y = i / width, X = i - Y*width;
+        return (Y / DEPTH_BLOCK)*blocks_x + X / DEPTH_BLOCK;
+    }
+
+    // Calls f with every pixel index in the block that pixel i is in
+    template <typename F> void for_block_pixels(int i, F f) {
+        const int Y = i / width, X = i - Y*width;
+        const int X0 = X - X % DEPTH_BLOCK, Y0 = Y - Y % DEPTH_BLOCK;
+        const int XEND = std::min(X0 + DEPTH_BLOCK, width), YEND = std::min(Y0 + DEPTH_BLOCK, height);
+        for (int y = Y0; y < YEND; y++)
+            for (int x = X0; x < XEND; x++)
+                f(y*width + x);
+    }
+
+    // 0 to 1 (clamped) to the closest step from 0 to max
+    static uint32_t encode(float z, float max) {
+        return (uint32_t)((z > 0 ? (z < 1 ? z : 1) : 0) * max + .5f);
+    }
+};
+
+#endif /* DEPTH_BUFFER_H */
@@ -0,0 +1,74 @@
+// Microbenchmark for Matrix4::multiply_batch
+// Transforms a big cloud of xyz points with every batch kernel this CPU can run
+// and with the old one point at a time multiply_mutate(Point4&), and checks they all give the same numbers.
+//
+// make matrix_bench && ./matrix_bench [number of points] [repeats]
+#include "Matrix4.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+    const int COUNT   = argc > 1 ? std::atoi(argv[1]) : 4000000;
+    const int REPEATS = argc > 2 ? std::atoi(argv[2]) : 5;
+
+    // Random points (xyz one after another, like rd_pointset and rd_polyset get them)
+    std::vector<float> points(COUNT * 3);
+    std::srand(631);
+    for (float& f : points)
+        f = (float)std::rand() / RAND_MAX * 20.0f - 10.0f;
+
+    // Something like a real Object to Clip transform
+    Matrix4 m = Matrix4::camera_to_clip(45, 1, 1000, 4.0f/3.0f)
+              * Matrix4::world_to_camera(0,0,-20, 0,0,0, 0,1,0)
+              * Matrix4(1,2,3).rotate_xy(30).rotate_yz(15).scale(2,2,2);
+
+    std::vector<float> x(COUNT), y(COUNT), z(COUNT), w(COUNT);
+
+    // Old way, one Point4 at a time
+    std::vector<float> expected(COUNT * 4);
+    double best = 1e30;
+    for (int r = 0; r < REPEATS; r++) {
+        const auto START = std::chrono::steady_clock::now();
+        for (int i = 0; i < COUNT; i++) {
+            Point4 p = Point4(points[i*3], points[i*3+1], points[i*3+2]);
+            m.multiply_mutate(p);
+            expected[i*4] = p.x; expected[i*4+1] = p.y; expected[i*4+2] = p.z; expected[i*4+3] = p.w;
+        }
+        best = std::min(best, seconds_since(START));
+    }
+    std::cout << "multiply_mutate: " << best*1000 << " ms (" << COUNT / best / 1e6 << " Mpoints/s)\n";
+
+    // Every batch kernel this CPU has
+    const char* KERNELS[] = {"avx", "sse", "scalar"};
+    for (const char* kernel : KERNELS) {
+        if (!Matrix4::batch_kernel(kernel)) {
+            std::cout << kernel << ": not supported\n";
+            continue;
+        }
+
+        best = 1e30;
+        for (int r = 0; r < REPEATS; r++) {
+            const auto START = std::chrono::steady_clock::now();
+            m.multiply_batch(points.data(), COUNT, 3, 3, x.data(), y.data(), z.data(), w.data());
+            best = std::min(best, seconds_since(START));
+        }
+
+        int mismatches = 0;
+        for (int i = 0; i < COUNT; i++)
+            if (x[i] != expected[i*4] || y[i] != expected[i*4+1] || z[i] != expected[i*4+2] || w[i] != expected[i*4+3])
+                mismatches++;
+
+        std::cout << kernel << ": " << best*1000 << " ms (" << COUNT / best / 1e6 << " Mpoints/s)"
+                  << (mismatches ? ", MISMATCHES: " : "") << (mismatches ? std::to_string(mismatches) : "") << "\n";
+        if (mismatches) return 1;
+    }
+    return 0;
+}
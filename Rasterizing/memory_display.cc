@@ -0,0 +1,49 @@
+#include <iostream>
+#include <iomanip>
+
+#include "memory_display.h"
+#include "pnm_display.h"
+#include "rd_display.h"
+#include "rd_error.h"
+
+// Memory display (Display "name" "Memory" "rgb", or "Null" for the type)
+// Frames are drawn into one contiguous image in memory (the PNM driver's, so display_pixels and the rest work the same)
+// and then just left there: no files, no X11, nothing in the way when timing the engine itself.
+// With the "checksum" mode, every finished frame gets an FNV-1a checksum of its pixels printed to stdout, one line each:
+//   "<name> frame <frame number> checksum <16 hex digits>"
+// so headless runs can still be checked against known good images.
+
+extern int frameNumberPPM; // Set by pnm_init_frame()
+
+static uint64_t last_checksum = 0;
+
+// 64 bit FNV-1a over every byte of the image
+static uint64_t checksum(const unsigned char* data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+int memory_init_display() {
+    last_checksum = 0;
+    return pnm_init_display();
+}
+
+// Nothing to do, the frame stays in display_pixels until the next one clears it
+int memory_end_frame() {
+    return RD_OK;
+}
+
+int memory_end_frame_checksum() {
+    last_checksum = checksum(display_pixels, (size_t)display_xSize * display_ySize * 3);
+    std::cout << display_name << " frame " << frameNumberPPM << " checksum "
+              << std::hex << std::setw(16) << std::setfill('0') << last_checksum << std::dec << std::setfill(' ') << std::endl;
+    return RD_OK;
+}
+
+uint64_t memory_frame_checksum() {
+    return last_checksum;
+}
@@ -0,0 +1,24 @@
+#ifndef MEMORY_DISPLAY_H
+#define MEMORY_DISPLAY_H
+
+#include <stdint.h>
+
+#if defined (__cplusplus)
+extern "C"
+{
+#endif
+
+	int memory_init_display(void);
+
+	int memory_end_frame(void);
+
+	int memory_end_frame_checksum(void);
+
+	// FNV-1a checksum of the last finished frame (0 before the first one)
+	uint64_t memory_frame_checksum(void);
+
+#if defined (__cplusplus)
+}
+#endif
+
+#endif /* MEMORY_DISPLAY_H */
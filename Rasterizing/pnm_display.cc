@@ -2,6 +2,10 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <thread> // For the frame writer
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 
 #include "pnm_display.h"
 #include "rd_display.h"
@@ -12,27 +16,81 @@ static const bool DEBUG_MODE = false;
 
 static const float BYTE_CONVERSION = 255; // colors are from 0.0 to 1.0, bytes are from 0 to 255, so just scale by 255
 
-std::vector<std::vector<char>> screen; // 2D vector representation of the ppm file
-char backR = 0, backG = 0, backB = 0; // background color saved as seperate chars for easy setting
+std::vector<unsigned char> screen; // The ppm image, every row back to back (also display_pixels, so the engine can write it directly)
+unsigned char backR = 0, backG = 0, backB = 0; // background color saved as seperate chars for easy setting
 int frameNumberPPM; // Saved value for the frame number
 int triple_xSize; // Only exists so the computer doesnt have to keep multiplying size by 3 every time
 
+// Frame writer
+// Finished frames are written to their ppm files by a background thread so the next frame can start rendering right away.
+// pnm_end_frame() hands screen over to it and takes a spare image to draw the next frame into (the writer gives them back when it's done).
+// At most MAX_QUEUED_FRAMES are waiting or being written at once (the one being written counts, it's still a whole image),
+// after that pnm_end_frame() waits for the writer to catch up.
+static const size_t MAX_QUEUED_FRAMES = 4;
+
+struct queued_frame {
+    std::string file_name;
+    std::vector<unsigned char> image;
+};
+
+static std::thread writer;
+static std::mutex writer_mutex;
+static std::condition_variable writer_wake;      // Something was queued (or it's time to stop)
+static std::condition_variable writer_done;      // Something was written
+static std::deque<queued_frame> queued_frames;   // Waiting to be written, oldest first
+static size_t frames_writing = 0;                // Taken off queued_frames by the writer and not written yet (0 or 1)
+static std::vector<std::vector<unsigned char>> spare_images; // Already written, can be drawn into again
+static bool stop_writer = false;
+
+static void write_frames() {
+    std::unique_lock<std::mutex> lock(writer_mutex);
+    while (true) {
+        writer_wake.wait(lock, [] { return stop_writer || !queued_frames.empty(); });
+        if (queued_frames.empty()) return; // Stopping, and nothing left
+
+        queued_frame frame = std::move(queued_frames.front());
+        queued_frames.pop_front();
+        frames_writing++;
+        lock.unlock();
+
+        std::ofstream ppm(frame.file_name, std::ios::binary);
+        // magic (ppm is "P6"), \n, Width and Height ASCII integers, \n, Max intensity value (0 to 65535), \n
+        ppm << "P6\n" << display_xSize << ' ' << display_ySize << "\n255\n";
+        ppm.write((const char*)frame.image.data(), frame.image.size()); // Copy image into ppm file
+        ppm.close();
+
+        lock.lock();
+        spare_images.push_back(std::move(frame.image));
+        frames_writing--;
+        writer_done.notify_all();
+    }
+}
+
+// Waits until every queued frame is written, then stops the writer
+static void finish_writing() {
+    if (!writer.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        stop_writer = true;
+    }
+    writer_wake.notify_one();
+    writer.join();
+    stop_writer = false;
+}
+
 // Where everything for initially setting up a device is done.
 // The global values display_xSize and display_ySize in rd_display.h are guaranteed to have valid values at this point.
-// This is where the 2D vector is dynamically allocated to temporarily hold the image.
+// This is where the image is dynamically allocated to temporarily hold the image.
 int pnm_init_display() {
     if (DEBUG_MODE) std::cout << "P1. DISPLAY:\n"
         << display_xSize << std::endl
         << display_ySize << std::endl;
 
-    // Initialize 2D vector
-    screen.resize(display_ySize);
-    screen.shrink_to_fit();
+    // One block for the whole image (row y starts at y*triple_xSize)
     triple_xSize = display_xSize * 3;
-    for (std::vector<char>& screenLine : screen) {
-        screenLine.resize(triple_xSize);
-        screenLine.shrink_to_fit();
-    }
+    screen.assign(display_ySize * triple_xSize, 0);
+    screen.shrink_to_fit();
+    display_pixels = screen.data();
 
     return RD_OK;
 }
@@ -40,6 +98,7 @@ int pnm_init_display() {
 // Called when the input file is finished.
 int pnm_end_display() {
     if (DEBUG_MODE) std::cout << "P2. DISPLAY END\n";
+    finish_writing(); // Every frame is on disk once this returns
     return RD_OK;
 }
 
@@ -51,50 +110,63 @@ int pnm_init_frame(int fn) {
     return RD_OK;
 }
 
-// Finishes and outputs the result to a ppm file
+// Finishes the frame and queues it up to be written to a ppm file (by the writer thread)
 int pnm_end_frame() {
     if (DEBUG_MODE) std::cout << "P4. FRAME END\n";
-    std::ofstream ppm;
     std::string uniqueExtension = "_" + std::to_string(frameNumberPPM) + ".ppm";
-    ppm.open(display_name + uniqueExtension, std::ios::binary);
 
-    // magic (ppm is "P6"), \n, Width and Height ASCII integers, \n, Max intensity value (0 to 65535), \n
-    ppm << "P6\n" << display_xSize << ' ' << display_ySize << "\n255\n";
+    std::unique_lock<std::mutex> lock(writer_mutex);
+    if (!writer.joinable())
+        writer = std::thread(write_frames);
 
-    // Copy vector into ppm file
-    for (std::vector<char>& screenLine : screen)
-        for (int x : screenLine)
-            ppm.put(x);
+    // Don't let the frames pile up (each one is a whole image)
+    writer_done.wait(lock, [] { return queued_frames.size() + frames_writing < MAX_QUEUED_FRAMES; });
 
-    ppm.close();
+    // Hand the image over and draw the next frame into a spare one (or a new one if the writer is still busy with them)
+    queued_frames.push_back({display_name + uniqueExtension, std::move(screen)});
+    if (!spare_images.empty()) {
+        screen = std::move(spare_images.back());
+        spare_images.pop_back();
+    } else
+        screen.assign(display_ySize * triple_xSize, 0);
+    display_pixels = screen.data();
+    lock.unlock();
+
+    writer_wake.notify_one();
     return RD_OK;
 }
 
 // Sets the image value at location (x, y) to the value of the current color.
 int pnm_write_pixel(int x, int y, const float rgb[]) {
     if (DEBUG_MODE) std::cout << "P5. WRITE: ";
-    int t = x*3;
-    std::vector<char>& screenLine = screen[y];
+    unsigned char* pixel = &screen[y*triple_xSize + x*3];
 
-    // +.5 for rounding when flooring with int cast
-    screenLine[t++] = (int)(rgb[0] * BYTE_CONVERSION + .5); // Red
-    screenLine[t++] = (int)(rgb[1] * BYTE_CONVERSION + .5); // Green
-    screenLine[t]   = (int)(rgb[2] * BYTE_CONVERSION + .5); // Blue
+    // rounded (+.5 when flooring with int cast)
+    pixel[0] = rd_color_byte(rgb[0]); // Red
+    pixel[1] = rd_color_byte(rgb[1]); // Green
+    pixel[2] = rd_color_byte(rgb[2]); // Blue
 
     if (DEBUG_MODE) std::cout << x << ' ' << y 
-        << " = " << screenLine[t-2] << ' ' << screenLine[t-1] << ' ' << screenLine[t] << std::endl;
+        << " = " << (int)pixel[0] << ' ' << (int)pixel[1] << ' ' << (int)pixel[2] << std::endl;
+    return RD_OK;
+}
+
+// Same for the pixels from (x0, y) up to (x1, y), rgb has 3 floats for each
+int pnm_write_span(int y, int x0, int x1, const float rgb[]) {
+    unsigned char* pixel = &screen[y*triple_xSize + x0*3];
+    for (int i = 0; i < (x1 - x0)*3; i++)
+        pixel[i] = rd_color_byte(rgb[i]);
     return RD_OK;
 }
 
 // Reads the value from location(x, y) in the array to the red, green, and blue values passed in.
 int pnm_read_pixel(int x, int y, float rgb[]) {
     if (DEBUG_MODE) std::cout << "P6. READ: ";
-    int t = x*3;
-    std::vector<char>& screenLine = screen[y];
+    const unsigned char* pixel = &screen[y*triple_xSize + x*3];
 
-    rgb[0] = (float)screenLine[t++] / BYTE_CONVERSION; // Red
-    rgb[1] = (float)screenLine[t++] / BYTE_CONVERSION; // Green
-    rgb[2] = (float)screenLine[t]   / BYTE_CONVERSION; // Blue
+    rgb[0] = (float)pixel[0] / BYTE_CONVERSION; // Red
+    rgb[1] = (float)pixel[1] / BYTE_CONVERSION; // Green
+    rgb[2] = (float)pixel[2] / BYTE_CONVERSION; // Blue
 
     if (DEBUG_MODE) std::cout << x << ' ' << y 
         << " = " << rgb[0] << ' ' << rgb[1] << ' ' << rgb[2] << std::endl;
@@ -106,26 +178,21 @@ int pnm_set_background(const float rgb[]) {
     if (DEBUG_MODE) std::cout << "P7. BACKGROUND\n"
         << rgb[0] << ' ' << rgb[1] << ' ' << rgb[2] << std::endl;
 
-    // +.5 for rounding when flooring with int cast
-    const int newBackR = (int)(rgb[0] * BYTE_CONVERSION + .5);
-    const int newBackG = (int)(rgb[1] * BYTE_CONVERSION + .5);
-    const int newBackB = (int)(rgb[2] * BYTE_CONVERSION + .5);
+    // rounded (+.5 when flooring with int cast)
+    const unsigned char newBackR = rd_color_byte(rgb[0]);
+    const unsigned char newBackG = rd_color_byte(rgb[1]);
+    const unsigned char newBackB = rd_color_byte(rgb[2]);
 
-    if (DEBUG_MODE) std::cout << newBackR << ' ' << newBackG << ' ' << newBackB << std::endl;
+    if (DEBUG_MODE) std::cout << (int)newBackR << ' ' << (int)newBackG << ' ' << (int)newBackB << std::endl;
     
     // Replace background
-    for (std::vector<char>& screenLine : screen) {
-        for (int i = 0; i < triple_xSize;) {
-            int ri = i++;
-            int gi = i++;
-            int bi = i++;
-            if (screenLine[ri] == backR
-             && screenLine[gi] == backG
-             && screenLine[bi] == backB) {
-                screenLine[ri] = newBackR;
-                screenLine[gi] = newBackG;
-                screenLine[bi] = newBackB;
-            }
+    for (size_t i = 0; i < screen.size(); i += 3) {
+        if (screen[i]   == backR
+         && screen[i+1] == backG
+         && screen[i+2] == backB) {
+            screen[i]   = newBackR;
+            screen[i+1] = newBackG;
+            screen[i+2] = newBackB;
         }
     }
     
@@ -140,12 +207,10 @@ int pnm_set_background(const float rgb[]) {
 int pnm_clear() {
     if (DEBUG_MODE) std::cout << "P8. CLEAR\n";
 
-    for (std::vector<char>& screenLine : screen) {
-        for (int i = 0; i < triple_xSize;) {
-            screenLine[i++] = backR; // Red
-            screenLine[i++] = backG; // Green
-            screenLine[i++] = backB; // Blue
-        }
+    for (size_t i = 0; i < screen.size();) {
+        screen[i++] = backR; // Red
+        screen[i++] = backG; // Green
+        screen[i++] = backB; // Blue
     }
 
     return RD_OK;
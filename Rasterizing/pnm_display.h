@@ -16,6 +16,8 @@ extern "C"
 
 	int pnm_write_pixel(int x, int y, const float rgb []);
 
+	int pnm_write_span(int y, int x0, int x1, const float rgb []);
+
 	int pnm_read_pixel(int x, int y, float rgb []);
 
 	int pnm_set_background(const float rgb []);
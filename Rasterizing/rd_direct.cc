@@ -3,8 +3,34 @@
 #include "rd_display.h"
 
 #include <cstring> // for memcpy
+#include <cstdint> // for uint64_t (packed fill)
 #include <iostream> // for debugging
-
+#include <algorithm> // for sorting edges in scan_conversion
+#include <chrono> // for the stage timers (OptionBool "Stats")
+#include <atomic> // for handing out tiles to the workers in flush_tiles
+#ifdef __SSE2__
+#include <emmintrin.h> // for the half-space rasterizer, the flood fill and rd_pointset
+#endif
+
+
+// Used by rd_engine.cc to make the engine (it can't include rd_direct.h, see there)
+RenderEngine* new_REDirect() {
+    return new REDirect;
+}
+
+// Adds the time from when it's made until it goes out of scope to seconds, or does nothing if on is false (OptionBool "Stats")
+// (off, it's one pointer and a test on each end: the clock is never read and start is left alone)
+struct stage_timer {
+    double* const seconds;
+    std::chrono::steady_clock::rep start;
+    stage_timer(bool on, double& total) : seconds(on ? &total : nullptr) {
+        if (on) start = std::chrono::steady_clock::now().time_since_epoch().count();
+    }
+    ~stage_timer() {
+        if (seconds) *seconds += std::chrono::duration<double>(
+            std::chrono::steady_clock::duration(std::chrono::steady_clock::now().time_since_epoch().count() - start)).count();
+    }
+};
 
 
 // Shaders
@@ -233,10 +259,25 @@ int REDirect::rd_render_init() {
 
     point_lights.clear();
     far_lights.clear();
+    light_arrays.clear();
 
     surface_shader = &matte; // Set class function pointer default to matte
 
-    std::cout << std::endl;  // I dont know why, but if this is also removed then random data is hit with immutable garbage and nothing works (maybe b/c of std::endl's flushing idk)
+    tiled_mode = false;
+    tile_threads = 0; // One per core
+    retained_mode = retained_frame = retained_valid = false;
+    background[0] = background[1] = background[2] = 0;
+    halfspace_rasterizer = false; // Scanline
+    depth_prepass = false;
+    occlusion_culling = false;
+    double_side = true;
+    span_shading = false;
+    span_kernel(); // Picks the kernel now, before any workers need it
+    stats = false;
+    divisions = 20;
+    tessellation_error = 0;
+    guard_band = 0;
+    z_buffer_format = DEPTH_FLOAT;
 
     return RD_OK;
 }
@@ -271,7 +312,7 @@ int REDirect::rd_world_begin() {
 
     // The camera to clipping coordinate transformation matrix can be computed using 
     // the near and far clipping depths and the field of view.
-    Matrix4 camera_to_clip = Matrix4::camera_to_clip(camera_fov, camera_near, camera_far, (float)display_xSize/display_ySize);
+    Matrix4 camera_to_clip = Matrix4::camera_to_clip(camera_fov, camera_near, camera_far, (float)display_xSize/display_ySize, z_buffer_format == DEPTH_REVERSED);
     // std::cout << "camera to clip:\n" << camera_to_clip << std::endl;
 
     // These last two transformations are combined and stored as the world to clipping coordinate matrix.
@@ -285,25 +326,102 @@ int REDirect::rd_world_begin() {
     // New empty transformation stack
     stack = std::stack<Matrix4>();
 
-    // Initialize new depth buffer with all values set to 1.0f
-    z_buffer = vector<float>(display_xSize*display_ySize, 1.0f);
+    // Initialize new depth buffer with all values set to the farthest depth (1.0f for float, 0.0f for reversed)
+    z_buffer.reset(z_buffer_format, display_xSize, display_ySize);
+
+    // Split the screen into tiles for tiled mode (the depth prepass and retained mode go through the tiles too, they have to hold on to the polygons)
+    tiles.clear();
+    retained_frame = retained_mode;
+    retained_flushed = false;
+    if (tiled_mode || depth_prepass || retained_frame) {
+        tiles_x = (display_xSize + TILE_SIZE - 1) / TILE_SIZE;
+        tiles_y = (display_ySize + TILE_SIZE - 1) / TILE_SIZE;
+        for (int ty = 0; ty < tiles_y; ty++) {
+            for (int tx = 0; tx < tiles_x; tx++) {
+                Tile tile;
+                tile.x0 = tx*TILE_SIZE; tile.x1 = std::min(tile.x0 + TILE_SIZE, display_xSize);
+                tile.y0 = ty*TILE_SIZE; tile.y1 = std::min(tile.y0 + TILE_SIZE, display_ySize);
+                tile.color.resize((tile.x1 - tile.x0)*(tile.y1 - tile.y0)*3);
+                tile.written.resize((tile.x1 - tile.x0)*(tile.y1 - tile.y0), false);
+                tile.pass = PASS_NORMAL;
+                tile.fragments_rejected = tile.fragments_shaded = tile.fragments_written = 0;
+                tile.depth_reads = tile.depth_writes = tile.polygons_occluded = 0;
+                tile.stage.clear();
+                tile.hash = 0;
+                tile.reused = false;
+                tiles.push_back(tile);
+            }
+        }
+    }
+
+    // Both transforms are new, so is everything cached from them
+    transform_changed();
 
-    // Dynamically initialize edge_table for scan_conversion();
-    edge_table = new Edge[display_ySize];
+    // Hierarchical Z, everything starts out as far as it gets
+    for (int level = 0; level < 2; level++) {
+        const int SIZE = level ? HIZ_SIZE*HIZ_SIZE : HIZ_SIZE;
+        hiz_w[level] = (display_xSize + SIZE - 1) / SIZE;
+        hiz_h[level] = (display_ySize + SIZE - 1) / SIZE;
+        hiz[level] = vector<float>(hiz_w[level]*hiz_h[level], z_buffer.farthest());
+        hiz_dirty[level] = vector<char>(hiz_w[level]*hiz_h[level], false);
+    }
 
-    // Normal transform matrix
-    normal_transform = Matrix4::identity();
+    // Stats
+    fragments_rejected = fragments_shaded = fragments_written = 0;
+    depth_reads = depth_writes = 0;
+    polygons_occluded = primitives_occluded = 0;
+    polygons_backfacing = primitives_outside = 0;
+    tiles_reused = 0;
+    stage.clear();
+    overdraw.assign(stats ? display_xSize*display_ySize : 0, 0);
 
     return RD_OK;
 }
 
 int REDirect::rd_world_end() {
-    delete[] edge_table;
+    flush_tiles(true); // Draw whatever is still waiting in the tiles
+
+    int result;
+    {
+        stage_timer timer(stats, stage.end_frame_time);
+        result = rd_disp_end_frame();
+    }
+
+    if (stats) {
+        std::cout << "Fragments rejected by depth: " << fragments_rejected
+                  << ", shaded: " << fragments_shaded << ", written: " << fragments_written << std::endl
+                  << "Occluded polygons: " << polygons_occluded << ", primitives: " << primitives_occluded << std::endl
+                  << "Back-facing polygons: " << polygons_backfacing << ", primitives outside the view: " << primitives_outside << std::endl
+                  << "Depth (" << z_buffer.name() << ", " << z_buffer.bytes_per_pixel() << " bytes a pixel) reads: " << depth_reads
+                  << ", writes: " << depth_writes << ", traffic: " << (depth_reads + depth_writes) * z_buffer.bytes_per_pixel() / 1024 << " KB" << std::endl;
+
+        std::cout << "Vertices transformed: " << stage.vertices << std::endl
+                  << "Polygons submitted: " << stage.polygons_submitted << ", culled: " << stage.polygons_culled
+                  << ", clipped: " << stage.polygons_clipped << ", rasterized: " << stage.polygons_rasterized << std::endl
+                  << "Edges built: " << stage.edges << ", spans: " << stage.spans << std::endl;
+
+        // Overdraw histogram, how many pixels were plotted 0, 1, 2, 3, 4, 5 to 7 and 8 or more times
+        const int BUCKETS = 7;
+        const char* LABELS[BUCKETS] = {"0", "1", "2", "3", "4", "5-7", "8+"};
+        long histogram[BUCKETS] = {};
+        for (uint16_t count : overdraw)
+            histogram[count < 5 ? count : count < 8 ? 5 : 6]++;
+        std::cout << "Overdraw (pixels plotted N times):";
+        for (int i = 0; i < BUCKETS; i++)
+            std::cout << " " << LABELS[i] << ": " << histogram[i];
+        std::cout << std::endl;
+
+        std::cout << "Time (ms) polygon pipeline: " << stage.pipeline_time*1000 << ", clipping: " << stage.clipping_time*1000
+                  << ", scan conversion: " << stage.raster_time*1000 << ", display end frame: " << stage.end_frame_time*1000 << std::endl;
+        if (retained_frame)
+            std::cout << "Retained tiles reused: " << tiles_reused << " of " << tiles.size() << std::endl;
+    }
     stack = std::stack<Matrix4>(); // stack.clear() via empty initialization
     z_buffer.clear();
     point_lights.clear();
     far_lights.clear();
-    return rd_disp_end_frame();
+    light_arrays.clear();
+    return result;
 }
 
 int REDirect::rd_frame_end() {
@@ -333,33 +451,79 @@ int REDirect::rd_color(const float color[]) {
 
 // Sets the color values to be used as the screen background color.
 int REDirect::rd_background(const float color[]) {
+    flush_tiles();
+    memcpy(background, color, sizeof background);
     return rd_set_background(color);
 }
 
+// Writes a pixel straight into the display's rows if it has them (display_pixels), otherwise through the driver
+static inline void write_pixel(int x, int y, const float color[3]) {
+    if (display_pixels) {
+        unsigned char* pixel = display_pixels + (y*display_xSize + x)*3;
+        pixel[0] = rd_color_byte(color[0]);
+        pixel[1] = rd_color_byte(color[1]);
+        pixel[2] = rd_color_byte(color[2]);
+    } else
+        rd_write_pixel(x, y, color);
+}
+
 // Plots a point using the current_color
 // x and y are screen coordinates, z is the screen 'depth' from 0.0 to 1.0, with 0 being the closest
 // True if plotted, else false and nothing happened
 bool REDirect::plot(int x, int y, float z, const float color[3]) {
     // std::cout << x << ", " << y << ", " << z << std::endl;
 
-    // Check z_buffer to see if this point is behind another and return early if so (0.0 is close, 1.0 is far)
-    if (z > z_buffer[y*display_xSize + x])
+    // Retained mode: points and lines wait in the tiles with the polygons, in order, until the end of the frame
+    if (retained_frame) {
+        if (x < 0 || y < 0 || x >= display_xSize || y >= display_ySize) return false;
+        const int INDEX = deferred_fragments.size();
+        deferred_fragments.push_back({x, y, z, {color[0], color[1], color[2]}});
+        tiles[(y / TILE_SIZE)*tiles_x + x / TILE_SIZE].polygons.push_back(-1 - INDEX);
+        return true;
+    }
+
+    // Check z_buffer to see if this point is behind another and return early if so (0.0 is close, 1.0 is far, unless reversed)
+    z = z_buffer.quantize(z);
+    if (!z_buffer.passes(z, z_buffer.read(y*display_xSize + x, z, depth_reads)))
         return false;
 
     // This point is closer, save and draw it (or over a 'farther' point)
-    z_buffer[y*display_xSize + x] = z;
-    rd_write_pixel(x, y, color);
+    z_buffer.write(y*display_xSize + x, z);
+    depth_writes++;
+    depth_written(x, y);
+    write_pixel(x, y, color);
+    if (!overdraw.empty() && overdraw[y*display_xSize + x] < UINT16_MAX)
+        overdraw[y*display_xSize + x]++;
     return true;
 }
 
-void REDirect::point_pipeline(float x, float y, float z) {
-    Point4 p = Point4(x, y, z); // Point "Object"
+// Same as above, but into the tile's own color buffer (its pixels get written to the display in flush_tiles())
+// Only the worker that owns this tile touches its slice of the z_buffer, so no locking is needed
+bool REDirect::plot(Tile& tile, int x, int y, float z, const float color[3]) {
+    z = z_buffer.quantize(z);
+    if (!z_buffer.passes(z, z_buffer.read(y*display_xSize + x, z, tile.depth_reads)))
+        return false;
 
-    current_transform.multiply_mutate(p); // Object to World
+    z_buffer.write(y*display_xSize + x, z);
+    tile.depth_writes++;
+    depth_written(x, y);
+    const int i = (y - tile.y0)*(tile.x1 - tile.x0) + (x - tile.x0);
+    tile.color[i*3]   = color[0];
+    tile.color[i*3+1] = color[1];
+    tile.color[i*3+2] = color[2];
+    tile.written[i] = true;
+    if (!overdraw.empty() && overdraw[y*display_xSize + x] < UINT16_MAX) // Tiles own their pixels, no locking here either
+        overdraw[y*display_xSize + x]++;
+    return true;
+}
 
-    // Lighting happens here (WIP)
+void REDirect::point_pipeline(float x, float y, float z) {
+    if (!retained_frame) flush_tiles(); // Points are plotted right away, so everything before them has to be drawn first (unless retained, see plot())
 
-    world_to_clip_transform.multiply_mutate(p); // World to Camera AND Camera to Clip
+    Point4 p = Point4(x, y, z); // Point "Object"
+    if (stats) stage.vertices++;
+
+    p = object_to_clip().multiply(p); // Object to World to Camera to Clip (all at once)
 
     // Point clipping
     if (p.x < 0 || 0 > p.w-p.x ||
@@ -622,6 +786,7 @@ void REDirect::line_pipeline(Vector3 v) {
 }
 void REDirect::line_pipeline(Vector3 v, bool finish_with_face) {
     if (lp_points.empty()) return point_pipeline(v.x,v.y,v.z); // Called with no points
+    if (!retained_frame) flush_tiles(); // Same as points
     lp_points.push(v);
     if (finish_with_face) lp_points.push(lp_points.front()); // Add beginning vector to end
 
@@ -629,8 +794,8 @@ void REDirect::line_pipeline(Vector3 v, bool finish_with_face) {
     Point4 first = Point4(lp_points.front());
     lp_points.pop();
     // Point4 end = Point4(x,y,z); // Also for the optional face drawing at the end
-    current_transform.multiply_mutate(first); // Object to World
-    world_to_clip_transform.multiply_mutate(first); // World to Camera AND Camera to Clip
+    first = object_to_clip().multiply(first); // Object to Clip
+    if (stats) stage.vertices += 1 + lp_points.size();
 
     // Same as last_kode = bit_kode_pack(end, last_bc)
     float last_bc[7] = {first.x, first.w-first.x, first.y, first.w-first.y, first.z, first.w-first.z, first.w}; // adding p.w so I can get it later (nothing to do with clipping)
@@ -647,9 +812,7 @@ void REDirect::line_pipeline(Vector3 v, bool finish_with_face) {
         Point4 p = Point4(lp_points.front());
         lp_points.pop();
 
-        // Object to Clip
-        current_transform.multiply_mutate(p); // Object to World
-        world_to_clip_transform.multiply_mutate(p); // World to Camera AND Camera to Clip
+        p = object_to_clip().multiply(p); // Object to Clip
 
         // Line clipping
         Point4 p0, p1;
@@ -687,18 +850,39 @@ bool       pp_flag[6]  = {}; // an array of flags to indicate whether the the pi
 // Helper function that takes an attributed point and a boundary. 
 // By using the selected boundary, this function computes the boundary coordinate of the point for that boundary
 // and returns whether or not the point is inside the boundary. 
-static bool polygon_inside(attr_point& p, int boundary_code) {
+// The x and y boundaries are pushed out by the guard band (-g*w <= x,y <= w+g*w, exactly the screen when g is 0)
+static bool polygon_inside(const attr_point& p, int boundary_code) {
+    const float GUARD = guard_band * p.coord[3];
     switch (boundary_code) {
-    case 0: return              p.coord[0] >= 0.0f; // Left   (  x)
-    case 1: return p.coord[3] - p.coord[0] >= 0.0f; // Right  (w-x)
-    case 2: return              p.coord[1] >= 0.0f; // Bottom (  y)
-    case 3: return p.coord[3] - p.coord[1] >= 0.0f; // Top    (w-y)
+    case 0: return              p.coord[0] + GUARD >= 0.0f; // Left   (  x)
+    case 1: return p.coord[3] + GUARD - p.coord[0] >= 0.0f; // Right  (w-x)
+    case 2: return              p.coord[1] + GUARD >= 0.0f; // Bottom (  y)
+    case 3: return p.coord[3] + GUARD - p.coord[1] >= 0.0f; // Top    (w-y)
     case 4: return              p.coord[2] >= 0.0f; // Back   (  z)
     case 5: return p.coord[3] - p.coord[2] >= 0.0f; // Front  (w-z)
     }
     return false; // Should never happen
 }
 
+// Bit b is set if p is outside of boundary b
+static int polygon_outcode(const attr_point& p) {
+    int code = 0;
+    for (int b = 0; b < 6; b++)
+        if (!polygon_inside(p, b))
+            code |= 1 << b;
+    return code;
+}
+
+// True if every point is outside the same side of the screen itself (not the guard band), so nothing of it could be drawn
+static bool polygon_off_screen(const std::vector<attr_point>& points) {
+    int all_outside = 0xF;
+    for (const attr_point& p : points) {
+        const float X = p.coord[0], Y = p.coord[1], W = p.coord[3];
+        all_outside &= (X < 0) | (W - X < 0) << 1 | (Y < 0) << 2 | (W - Y < 0) << 3;
+    }
+    return all_outside != 0;
+}
+
 // Helper function that takes two attributed points and a boundary.
 // Simply calculates the "inside" values above for the two points 
 // and returns true or false depending on whether the values are equal or not. 
@@ -713,11 +897,12 @@ static bool polygon_cross(attr_point& p1, attr_point& p2, int boundary_code) {
 // Use only what's needed for the given boundary. When interpolating, interpolate all of the coordinates of the points.
 static attr_point polygon_intersect(attr_point& p1, attr_point& p2, int boundary_code) {
     float a1, a2; // Calculate boundary intersection alpha (0 to 1 for 0 to w)
+    const float G1 = guard_band * p1.coord[3], G2 = guard_band * p2.coord[3]; // Same guard band as polygon_inside
     switch (boundary_code) {
-    case 0: a1 =               p1.coord[0]; a2 =               p2.coord[0]; break; // Left   (  x)
-    case 1: a1 = p1.coord[3] - p1.coord[0]; a2 = p2.coord[3] - p2.coord[0]; break; // Right  (w-x)
-    case 2: a1 =               p1.coord[1]; a2 =               p2.coord[1]; break; // Bottom (  y)
-    case 3: a1 = p1.coord[3] - p1.coord[1]; a2 = p2.coord[3] - p2.coord[1]; break; // Top    (w-y)
+    case 0: a1 =                    p1.coord[0] + G1; a2 =                    p2.coord[0] + G2; break; // Left   (  x)
+    case 1: a1 = p1.coord[3] + G1 - p1.coord[0];      a2 = p2.coord[3] + G2 - p2.coord[0];      break; // Right  (w-x)
+    case 2: a1 =                    p1.coord[1] + G1; a2 =                    p2.coord[1] + G2; break; // Bottom (  y)
+    case 3: a1 = p1.coord[3] + G1 - p1.coord[1];      a2 = p2.coord[3] + G2 - p2.coord[1];      break; // Top    (w-y)
     case 4: a1 =               p1.coord[2]; a2 =               p2.coord[2]; break; // Back   (  z)
     case 5: a1 = p1.coord[3] - p1.coord[2]; a2 = p2.coord[3] - p2.coord[2]; break; // Front  (w-z)
     }
@@ -790,69 +975,104 @@ int polygon_clipping() {
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Span kernels
+// Which slots of an attr_point each attr_format interpolates. x and z are always needed (where the pixel is and the depth test),
+// the shaders need the world position and the constant to divide it by, and the normal only when it's interpolated.
+// y comes from the scanline and nothing reads the vertex colors or texture coordinates yet, so those are never stepped.
+// Everything below loops over these instead of all ATTR_SIZE floats (the slots left out are garbage, don't read them).
+template <int FORMAT> struct attr_slots;
+template <> struct attr_slots<ATTRS_DEPTH> {
+    static constexpr int SLOT[] = {0, 2};
+};
+template <> struct attr_slots<ATTRS_FLAT> {
+    static constexpr int SLOT[] = {0, 2, ATTR_CONSTANT, ATTR_WORLD_X, ATTR_WORLD_Y, ATTR_WORLD_Z};
+};
+template <> struct attr_slots<ATTRS_SMOOTH> {
+    static constexpr int SLOT[] = {0, 2, ATTR_CONSTANT, ATTR_NX, ATTR_NY, ATTR_NZ, ATTR_WORLD_X, ATTR_WORLD_Y, ATTR_WORLD_Z};
+};
+
+// Calls the shader directly (so it can be inlined) unless it's one rd_surface doesn't know about
+template <int SHADER> static inline void shade(float color[3]) {
+    switch (SHADER) {
+    case SHADER_MATTE:   matte(color);   break;
+    case SHADER_METAL:   metal(color);   break;
+    case SHADER_PLASTIC: plastic(color); break;
+    default: surface_shader(color);
+    }
+}
+
+
 // Scan conversion
-bool buildEdgeList(std::vector<attr_point> &points, int count, Edge* edge_table);
-void makeEdgeRec(attr_point& upper, attr_point& lower, Edge* edge_table);
-void addActiveList(int scan, Edge* AET, Edge* edge_table);
-void insertEdge(Edge* list, Edge* e);
-void updateAET(int scanline, Edge* active);
-void deleteAfter(Edge* q);
-void resortAET(Edge* active);
-void fill_between_the_edges(int scanline, Edge* active, REDirect& _this);
-
-// bool buildEdgeList(std::vector<attr_point> &points, int count);
-
-// The Edge Table
-// An edge table (an array of Edges) should be dynamically created at the same time the z-buffer is created. 
-// The array should have an edge for every scanline of the image. Most of the values in the edges are not used. 
-// All that is needed is the pointer to the edges associated with each scan line.
-// These pointers should be initialized to null pointer values. 
-// If the scan conversion algorithm is implemented correctly, the initialization should only need to be done once. 
-// The edge table should be freed up at the same time the z-buffer is returned to the system memory pool.
-// Edge* edge_table = new Edge[display_ySize]; in rd_world_begin();
+template <int FORMAT> bool buildEdgeList(const attr_point* points, int count, EdgePool& pool);
+template <int FORMAT> void makeEdgeRec(const attr_point& upper, const attr_point& lower, EdgePool& pool);
+void addActiveList(int scan, size_t& next, EdgePool& pool);
+void insertEdge(std::vector<Edge*>& list, Edge* e);
+template <int FORMAT> void edge_at(Edge& e, int scanline);
+template <int FORMAT> void updateAET(int scanline, EdgePool& pool);
+void resortAET(EdgePool& pool);
+template <int FORMAT, int SHADER> void fill_between_the_edges(int scanline, const std::vector<Edge*>& active, Tile* tile, REDirect& _this);
+
+// The Edge Pool
+// Instead of an edge table with a list of new'd edges for every scanline of the image, 
+// all the edges of a polygon are made in one EdgePool (REDirect::edge_pool, or one per worker in tiled mode)
+// and sorted by the scanline they start on. The pool is cleared for every polygon without giving its memory back.
+
+// Values along edges and spans are worked out from where they start (start + k * inc) instead of adding inc once per scanline or pixel.
+// Adding it up rounds differently depending on where it started, so a tile (or the guard band) skipping ahead gave
+// slightly different depths than drawing the whole polygon, and depth ties went the other way.
 
 
 // scan_convert()
 // This is the main function for scan converting a polygon. 
 // It takes an array of attributed points (and most likely an integer indicating the number of attributed points in the polygon). 
+// If a tile is given, only the pixels inside of it are drawn (into the tile instead of the display).
 // Pseudo-code for the scan conversion is given:
-void scan_conversion(REDirect& _this) {
-    // return scan_conversion_test(_this);
-    
-    // Clear edge table
-    for (int i = 0; i < display_ySize; i++)
-        _this.edge_table[i].next = nullptr;
+template <int FORMAT, int SHADER>
+void scan_conversion(const attr_point* points, int count, EdgePool& pool, Tile* tile, REDirect& _this) {
+    // Clear the pool and the AET
+    pool.edges.clear();
+    pool.active.clear();
 
-    Edge* AET = new Edge; // Local variables: An Edge which represents the head of the active edge table (AET)
-
-    if (!buildEdgeList(pp_clipped, pp_clipped.size(), _this.edge_table))
+    if (!buildEdgeList<FORMAT>(points, count, pool))
         return; // No edges cross a scanline
 
-    AET->next = nullptr; // clear the AET
+    // Sort edges by first scanline (stable so edges starting on the same scanline stay in the order they were made)
+    std::stable_sort(pool.edges.begin(), pool.edges.end(), [](const Edge& a, const Edge& b) { return a.yFirst < b.yFirst; });
+
+    // Edges that start above the screen (only left in by the guard band) or the tile start on its top instead, or are dropped if they end before it
+    // (so a tall polygon isn't stepped all the way down to every tile it touches)
+    const int FIRST = tile ? tile->y0 : 0;
+    const int LAST  = tile ? tile->y1 : display_ySize;
+    const int START = std::max(pool.edges[0].yFirst, FIRST);
+    size_t next = 0; // The next edge in the pool that isn't in the AET yet
+    for (; next < pool.edges.size() && pool.edges[next].yFirst < START; next++) {
+        Edge& e = pool.edges[next];
+        if (e.yLast < START) continue;
+        edge_at<FORMAT>(e, START);
+        insertEdge(pool.active, &e);
+    }
 
-    // Loop an integer, scan, over the scanlines of the display
-    for (int scan = 0; scan < display_ySize; scan++) {
-        // Take the edges starting on this scanline from the edge table
+    // Loop an integer, scan, over the scanlines of the polygon (or just the ones in the tile)
+    for (int scan = START; scan < LAST && (next < pool.edges.size() || !pool.active.empty()); scan++) {
+        // Take the edges starting on this scanline from the pool
         // and add them to the active edge table (AET).
-        if (_this.edge_table[scan].next != nullptr)
-            addActiveList(scan, AET, _this.edge_table);
+        addActiveList(scan, next, pool);
 
-        if (AET->next != nullptr) { // if AET is not empty
-            fill_between_the_edges(scan, AET, _this); // fill between the edge pairs in the AET
-            updateAET(scan, AET); // update the AET
-            resortAET(AET); // re-sort the AET
+        if (!pool.active.empty()) { // if AET is not empty
+            fill_between_the_edges<FORMAT, SHADER>(scan, pool.active, tile, _this); // fill between the edge pairs in the AET
+            updateAET<FORMAT>(scan, pool); // update the AET
+            resortAET(pool); // re-sort the AET
         }
     }
-
-    delete AET;
 }
 
 // buildEdgeList
-// This routine takes an array of attributed points and a count and places the edges created by the points into the edge table ET. It returns a flag value indicating whether or not the polygon crossed a scanline.
+// This routine takes an array of attributed points and a count and places the edges created by the points into the edge pool. It returns a flag value indicating whether or not the polygon crossed a scanline.
 // Local variables:   v1 and v2 are indices into the attributed point
 // array.  v1 is the trailing vertex of the edge.  v2 is the leading
 // vertex of the edge.  A scanline_crossed variable.
-bool buildEdgeList(std::vector<attr_point> &points, int count, Edge* edge_table) {
+template <int FORMAT>
+bool buildEdgeList(const attr_point* points, int count, EdgePool& pool) {
     bool scanline_crossed = false;
 
     int v1 = count - 1;  // The last vertex in the polygon
@@ -863,9 +1083,9 @@ bool buildEdgeList(std::vector<attr_point> &points, int count, Edge* edge_table)
             scanline_crossed = true;
 
             if (points[v1].coord[1] < points[v2].coord[1]) {
-                makeEdgeRec(points[v2], points[v1], edge_table); // Make an edge record from vertex[v1] to vertex[v2]
+                makeEdgeRec<FORMAT>(points[v2], points[v1], pool); // Make an edge record from vertex[v1] to vertex[v2]
             } else {
-                makeEdgeRec(points[v1], points[v2], edge_table); // Make an edge record from vertex[v2] to vertex[v1]
+                makeEdgeRec<FORMAT>(points[v1], points[v2], pool); // Make an edge record from vertex[v2] to vertex[v1]
             }
         }
 
@@ -876,129 +1096,171 @@ bool buildEdgeList(std::vector<attr_point> &points, int count, Edge* edge_table)
 }
 
 // makeEdgeRec
-// This routine takes two attributed points, upper and lower, and inserts an Edge created from those two points into the edge table (ET).
+// This routine takes two attributed points, upper and lower, and adds an Edge created from those two points to the edge pool.
 // Local variables:  two floating point values, dy and factor.  Also a
-// pointer e for the new Edge created.
-void makeEdgeRec(attr_point& upper, attr_point& lower, Edge* edge_table) {
+// reference e for the new Edge created.
+template <int FORMAT>
+void makeEdgeRec(const attr_point& upper, const attr_point& lower, EdgePool& pool) {
     float dy = upper.coord[1] - lower.coord[1];
 
-    // Dynamically allocate a new edge.  Pointer to same is stored in e.
-    Edge *e = new Edge;
-    e->next = nullptr;
+    // Take a new edge from the end of the pool.
+    pool.edges.emplace_back();
+    Edge& e = pool.edges.back();
 
     // Calculate the edge value increments between scan lines
-    for (int i = 0; i < ATTR_SIZE; i++)
-        e->inc.coord[i] = (upper.coord[i] - lower.coord[i]) / dy;
+    for (int i : attr_slots<FORMAT>::SLOT)
+        e.inc.coord[i] = (upper.coord[i] - lower.coord[i]) / dy;
 
     // Edge starts on scanline ceil(lower.y)
     float factor = std::ceil(lower.coord[1]) - lower.coord[1];  // Gives the fractional position of the first scanline crossing
 
     // Calculate the starting values for the edge
-    // e->p = lower + factor * e->inc
-    for (int i = 0; i < ATTR_SIZE; i++)
-        e->p.coord[i] = lower.coord[i] + factor * e->inc.coord[i];
-
-    // Find the last scanline for the edge
-    e->yLast = std::ceil(upper.coord[1]) - 1;
+    // e.first = lower + factor * e.inc
+    for (int i : attr_slots<FORMAT>::SLOT)
+        e.p.coord[i] = e.first.coord[i] = lower.coord[i] + factor * e.inc.coord[i];
 
-    // Insert e into the edge table list of edges starting on scanline ceil(lower.y)
-    int scanindex = std::ceil(lower.coord[1]);
-    if (edge_table[scanindex].next == nullptr) {
-        edge_table[scanindex].next = e;
-    } else {
-        Edge *current = edge_table[scanindex].next;
-
-        // Set last edge to e
-        while (current->next != nullptr)
-            current = current->next;
-        current->next = e;
-    }
+    // Find the first and last scanline for the edge
+    e.yFirst = std::ceil(lower.coord[1]);
+    e.yLast = std::ceil(upper.coord[1]) - 1;
 }
 
-void addActiveList(int scan, Edge* AET, Edge* edge_table) {
-    //This routine takes an integer scanline and a pointer to an Edge, the AET.
-    Edge *p, *q;
-
-    p = edge_table[scan].next; // Get the edges starting on this scan line
-
-    while(p) {
-        q = p->next;  // Hold the rest of the list
-        insertEdge(AET, p);
-        p = q;
-    }
+void addActiveList(int scan, size_t& next, EdgePool& pool) {
+    // This routine takes an integer scanline and the index of the next edge in the pool that isn't active yet.
+    // Moves all the edges starting on this scanline into the AET.
+    while (next < pool.edges.size() && pool.edges[next].yFirst == scan)
+        insertEdge(pool.active, &pool.edges[next++]);
+}
 
-    // Keep edge table clean -- edges have been transfered
-    edge_table[scan].next = 0;
+// Edges with the same x are kept in pool order, so the AET comes out the same no matter which scanline they were added on
+static inline bool edge_before(const Edge* a, const Edge* b) {
+    return a->p.coord[0] < b->p.coord[0] || (a->p.coord[0] == b->p.coord[0] && a < b);
 }
 
-void insertEdge(Edge* list, Edge* e) {
-    // This routine takes two pointers to Edges, a linked list and an Edge e, to be inserted into that list. 
+void insertEdge(std::vector<Edge*>& list, Edge* e) {
+    // This routine takes the AET and an Edge e, to be inserted into it. 
     // The list is to be maintained sorted by increasing x coordinate values of the edges in the list.
-    Edge *p, *q = list;
+    size_t i = 0;
+    while (i < list.size() && edge_before(list[i], e))
+        i++; // Step to the next edge
 
-    // p leads
-    p = q->next;
-
-    while (p != 0 && (e->p.coord[0] > p->p.coord[0])) {
-        // Step to the next edge
-        q = p;
-        p = p->next;
-    }
+    list.insert(list.begin() + i, e);
+}
 
-    // Link the edge into the list after q
-    e->next = q->next;
-    q->next = e;
+// Moves an edge to a scanline (p = first + (scanline - yFirst) * inc)
+template <int FORMAT>
+void edge_at(Edge& e, int scanline) {
+    const float STEPS = scanline - e.yFirst;
+    for (int i : attr_slots<FORMAT>::SLOT)
+        e.p.coord[i] = e.first.coord[i] + STEPS * e.inc.coord[i];
 }
 
-void updateAET(int scanline, Edge* active) {
-    // This function takes an integer scanline and a pointer to an Edge the AET.
-    Edge *q = active, *p = active->next;
-    // p leads
+template <int FORMAT>
+void updateAET(int scanline, EdgePool& pool) {
+    // This function takes an integer scanline and the edge pool with the AET.
+    // Edges on their last scanline are dropped (the rest are compacted down), the others are stepped to the next scanline.
+    size_t kept = 0;
+    for (Edge* p : pool.active) {
+        if (scanline == p->yLast) // This is the last scanline for this edge
+            continue;
 
-    while(p) {
-        if (scanline == p->yLast) { // This is the last scanline for this edge
-            p = p->next;    // Move p along
-            deleteAfter(q);  // get rid of old node
-        } else {
-            // Update the attribute values
-            // p->p += p->inc;
-            for (int i = 0; i < ATTR_SIZE; i++)
-                p->p.coord[i] += p->inc.coord[i];
+        // Update the attribute values
+        // p->p = p->first + (scanline + 1 - p->yFirst) * p->inc;
+        edge_at<FORMAT>(*p, scanline + 1);
 
-            q = p;
-            p = p->next;
+        pool.active[kept++] = p;
+    }
+    pool.active.resize(kept);
+}
+
+void resortAET(EdgePool& pool) {
+    // This function takes the edge pool, and resorts the AET by increasing x values. It does this by taking all of the edges out of the active edge list and then reinserting them into the active edge table.
+    pool.resort.swap(pool.active);
+    pool.active.clear();
+    for (Edge* p : pool.resort)
+        insertEdge(pool.active, p);
+}
+
+
+// Stores the attributes of value in the global surface_point_values (divided by the interpolated constant in value)
+// and calculates the color for that pixel with the surface shader
+template <int FORMAT, int SHADER>
+static void shade_fragment(const attr_point& value, float color[3]) {
+    // The attributes in the value variable need to be stored in the global surface_point_values variable
+    // and divided by the interpolated constant in that value. 
+    // This will give the proper interpolated world coordinate values for the attributes. 
+    // The attributes in value should not be changed.
+    const float CONSTANT = value.coord[ATTR_CONSTANT];
+    for (int i : attr_slots<FORMAT>::SLOT) // Copy into surface_point_values and divide values by CONSTANT
+        surface_point_values.coord[i] = i >= ATTR_R ? value.coord[i] / CONSTANT : value.coord[i];
+
+    shade<SHADER>(color);
+}
+
+// Everything a rasterizer does with a pixel of a polygon once its attributes are interpolated.
+// The depth test comes first so hidden fragments are never divided out or shaded.
+// In a depth prepass the first pass only writes depth, and the second only shades the fragments that won it.
+template <int FORMAT, int SHADER>
+void REDirect::fragment(int x, int y, const attr_point& value, Tile* tile) {
+    const float z = z_buffer.quantize(value.coord[2]);
+    const int PIXEL = y*display_xSize + x;
+    const float depth = z_buffer.read(PIXEL, z, tile ? tile->depth_reads : depth_reads);
+
+    const raster_pass PASS = tile ? tile->pass : PASS_NORMAL;
+    if (PASS == PASS_DEPTH_ONLY) {
+        if (z_buffer.passes(z, depth)) {
+            z_buffer.write(PIXEL, z);
+            tile->depth_writes++;
+            depth_written(x, y);
         }
+        return;
     }
-}
 
-void deleteAfter(Edge* q) {
-    // This function takes a pointer to an Edge q. The node after this Edge is to be deleted.
-    Edge *p = q->next;
+    // Counted per tile in tiled mode (summed up in flush_tiles) so the workers don't share counters
+    long& rejected = tile ? tile->fragments_rejected : fragments_rejected;
+    long& shaded   = tile ? tile->fragments_shaded   : fragments_shaded;
+    long& plotted  = tile ? tile->fragments_written  : fragments_written;
 
-    q->next = p->next;
-    delete p;
-}
+    // Something closer is already there (or won the prepass)
+    if (!z_buffer.passes(z, depth) || (PASS == PASS_SHADE_EQUAL && z != depth)) {
+        rejected++;
+        return;
+    }
 
-void resortAET(Edge* active) {
-    // This function takes a pointer to an Edge, the active edge table, and resorts it by increasing x values. It does this by taking all of the edges out of the active edge list and then reinserting them into the active edge table.
-    Edge *q, *p = active->next;
+    // Shaded later with the rest of the batch (the depth test already passed, and a polygon never covers a pixel twice)
+    if (span_shading && SHADER != SHADER_OTHER) {
+        span_fragments& batch = pending_span.fragments;
+        const int i = batch.count++;
+        pending_span.x[i] = x; pending_span.y[i] = y; pending_span.z[i] = z;
+
+        const float CONSTANT = value.coord[ATTR_CONSTANT]; // Same as get_surface_normal() and get_surface_position()
+        if (FORMAT == ATTRS_SMOOTH) {
+            batch.nx[i] = value.coord[ATTR_NX] / CONSTANT;
+            batch.ny[i] = value.coord[ATTR_NY] / CONSTANT;
+            batch.nz[i] = value.coord[ATTR_NZ] / CONSTANT;
+        } else {
+            batch.nx[i] = polygon_normal.x; batch.ny[i] = polygon_normal.y; batch.nz[i] = polygon_normal.z;
+        }
+        batch.px[i] = value.coord[ATTR_WORLD_X] / CONSTANT;
+        batch.py[i] = value.coord[ATTR_WORLD_Y] / CONSTANT;
+        batch.pz[i] = value.coord[ATTR_WORLD_Z] / CONSTANT;
 
-    active->next = 0;
-    while(p) {
-        q = p->next;
-        insertEdge(active, p);
-        p = q;
+        if (batch.count == SPAN_SIZE)
+            flush_span((shader_kind)SHADER, tile);
+        return;
     }
-}
-
 
-void fill_between_the_edges(int scanline, Edge* active, REDirect& _this) {
-    // This function takes a scan line and a pointer to an edge, the active edge table. It fills in the pixels between edge pairs in the table
-    Edge *p1, *p2;
+    float color[3]; // return value from shader
+    shade_fragment<FORMAT, SHADER>(value, color); // Get color to shade
+    shaded++;
+    if (tile ? plot(*tile, x, y, z, color) : plot(x, y, z, color))
+        plotted++;
+}
 
-    p1 = active->next;
-    while (p1) {
-        p2 = p1->next;  // Get the pair of edges from the AET
+template <int FORMAT, int SHADER>
+void fill_between_the_edges(int scanline, const std::vector<Edge*>& active, Tile* tile, REDirect& _this) {
+    // This function takes a scan line and the active edge table. It fills in the pixels between edge pairs in the table
+    for (size_t pair = 0; pair + 1 < active.size(); pair += 2) {
+        const Edge *p1 = active[pair], *p2 = active[pair+1];  // Get the pair of edges from the AET
 
         if (p1->p.coord[0] != p2->p.coord[0]) {// if(the x values are not equal) {
             // Calculate the attribute increments along the scanline
@@ -1006,48 +1268,251 @@ void fill_between_the_edges(int scanline, Edge* active, REDirect& _this) {
 
             // inc = (p2 - p1) / dx
             attr_point inc;
-            for (int i = 0; i < ATTR_SIZE; i++)
+            for (int i : attr_slots<FORMAT>::SLOT)
                 inc.coord[i] = (p2->p.coord[i] - p1->p.coord[i]) / dx;
 
 
-            // Calculate the starting values for the edge
-            float factor = std::ceil(p1->p.coord[0]) - p1->p.coord[0]; // Gives the fractional position of the first pixel crossing
+            // Calculate the starting values for the span (on x0, the first pixel right of p1)
+            const float x0 = std::ceil(p1->p.coord[0]);
+            float factor = x0 - p1->p.coord[0]; // Gives the fractional position of the first pixel crossing
 
-            // value = p1 + factor * inc;
-            attr_point value;
-            for (int i = 0; i < ATTR_SIZE; i++)
-                value.coord[i] = p1->p.coord[i] + factor * inc.coord[i];
+            // start = p1 + factor * inc;
+            attr_point start, value;
+            for (int i : attr_slots<FORMAT>::SLOT)
+                start.coord[i] = p1->p.coord[i] + factor * inc.coord[i];
 
-            float endx = std::ceil(p2->p.coord[0]);
+            // Only draw inside of the tile or the screen (skip ahead to its left side, the guard band can leave spans hanging off of it)
+            const int XLO = tile ? tile->x0 : 0, XHI = tile ? tile->x1 : display_xSize;
+            const float firstx = std::max(x0, (float)XLO);
+            const float endx = std::min(std::ceil(p2->p.coord[0]), (float)XHI);
+            if (_this.stats && firstx < endx)
+                (tile ? tile->stage : _this.stage).spans++;
 
-            while (value.coord[0] < endx) {
-                // The attributes in the value variable need to be stored in the global surface_point_values variable
-                // and divided by the interpolated constant in that value. 
-                // This will give the proper interpolated world coordinate values for the attributes. 
-                // The attributes in value should not be changed.
-                surface_point_values = attr_point(value); // Copy into surface_point_values
-                const float CONSTANT = value.coord[ATTR_CONSTANT];
-                for (int i = ATTR_R; i < ATTR_SIZE; i++) // Divide values by CONSTANT
-                    surface_point_values.coord[i] /= CONSTANT;
+            for (int x = firstx; x < endx; x++) {
+                // value = start + (x - x0) * inc;
+                const float STEPS = x - x0;
+                for (int i : attr_slots<FORMAT>::SLOT)
+                    value.coord[i] = start.coord[i] + STEPS * inc.coord[i];
+                value.coord[0] = x;
 
-                // Calculate the color for the pixel and plot it.
-                float color[3]; // return value from shader
-                surface_shader(color); // Get color to shade
+                // Depth test, then shade and plot (y is the current scanline)
+                _this.fragment<FORMAT, SHADER>(x, scanline, value, tile);
+            }
+        }
+    }
+}
 
-                // x and z come from the current values, y is the current scanline
-                _this.plot(value.coord[0], scanline, value.coord[2], color);
 
-                // Increment the values
-                // value += inc;
-                for (int i = 0; i < ATTR_SIZE; i++)
-                    value.coord[i] += inc.coord[i];
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Half-space rasterizer (OptionString "Rasterizer" "halfspace")
+// Only for triangles, everything else still goes through scan_conversion.
+// Instead of walking edges down the scanlines, every pixel in the bounding box is tested against the three edge functions
+// of the triangle, E(x,y) = A*x + B*y + C (flipped so the inside is positive). Blocks of 8x8 pixels that are completely
+// outside of an edge are skipped, then the rest are tested 2x2 pixels at a time (coverage and depth with SSE when available)
+// and only the pixels that pass get their attributes interpolated and shaded.
+// Pixels exactly on an edge follow the same rule as the scanline version: left and top (smaller y) edges are included.
+#define HALFSPACE_BLOCK 8 // Size of the blocks skipped at once
+
+template <int FORMAT, int SHADER>
+void REDirect::halfspace_triangle(const attr_point* points, Tile* tile) {
+    const attr_point &v0 = points[0], &v1 = points[1], &v2 = points[2];
+    const float X0 = v0.coord[0], Y0 = v0.coord[1];
+    const float X1 = v1.coord[0], Y1 = v1.coord[1];
+    const float X2 = v2.coord[0], Y2 = v2.coord[1];
+
+    const float DET = (X1-X0)*(Y2-Y0) - (X2-X0)*(Y1-Y0); // Twice the signed area
+    if (DET == 0) return; // Degenerate, no pixels
+
+    // Edge functions, one per edge (a to b) with the inside on the same side as the vertex opposite of it
+    const float XS[3] = {X0, X1, X2}, YS[3] = {Y0, Y1, Y2};
+    float A[3], B[3], C[3];
+    bool inclusive[3];
+    for (int i = 0; i < 3; i++) {
+        const int a = i, b = (i+1)%3, c = (i+2)%3;
+        A[i] = YS[b] - YS[a];
+        B[i] = XS[a] - XS[b];
+        C[i] = -(A[i]*XS[a] + B[i]*YS[a]);
+        if (A[i]*XS[c] + B[i]*YS[c] + C[i] < 0) { // Opposite vertex is negative, flip
+            A[i] = -A[i]; B[i] = -B[i]; C[i] = -C[i];
+        }
+        inclusive[i] = A[i] > 0 || (A[i] == 0 && B[i] > 0); // Left or top edge
+    }
+
+    // Attribute setup, every attribute is a plane: a(x,y) = a0 + (x-X0)*dadx + (y-Y0)*dady
+    attr_point dadx, dady;
+    for (int i : attr_slots<FORMAT>::SLOT) {
+        const float DA1 = v1.coord[i] - v0.coord[i];
+        const float DA2 = v2.coord[i] - v0.coord[i];
+        dadx.coord[i] = (DA1*(Y2-Y0) - DA2*(Y1-Y0)) / DET;
+        dady.coord[i] = (DA2*(X1-X0) - DA1*(X2-X0)) / DET;
+    }
+
+    // Bounding box, clamped to the area being drawn (the screen or the tile)
+    const int XLO = tile ? tile->x0 : 0, XHI = tile ? tile->x1 : display_xSize;
+    const int YLO = tile ? tile->y0 : 0, YHI = tile ? tile->y1 : display_ySize;
+    const int xstart = std::max(XLO, (int)std::floor(std::min(X0, std::min(X1, X2)))) & ~1; // Even so the 2x2 blocks line up
+    const int ystart = std::max(YLO, (int)std::floor(std::min(Y0, std::min(Y1, Y2)))) & ~1; // (XLO and YLO are always even)
+    const int xend = std::min(XHI - 1, (int)std::ceil(std::max(X0, std::max(X1, X2))));
+    const int yend = std::min(YHI - 1, (int)std::ceil(std::max(Y0, std::max(Y1, Y2))));
+
+#ifdef __SSE2__
+    const __m128 LANE_X = _mm_setr_ps(0, 1, 0, 1); // Lane order: (x,y) (x+1,y) (x,y+1) (x+1,y+1)
+    const __m128 LANE_Y = _mm_setr_ps(0, 0, 1, 1);
+    const __m128 ZERO = _mm_setzero_ps();
+    const bool EXACT_DEPTH = z_buffer.exact(), REVERSED = z_buffer.reversed();
+    const float NEVER_PASSES = REVERSED ? 2.0f : -2.0f, ALWAYS_PASSES = REVERSED ? -INFINITY : INFINITY;
+#endif
+
+    for (int by = ystart; by <= yend; by += HALFSPACE_BLOCK) {
+        for (int bx = xstart; bx <= xend; bx += HALFSPACE_BLOCK) {
+            // Skip the block if it's completely outside of any edge (test the corner where that edge function is biggest)
+            bool outside = false;
+            for (int i = 0; i < 3 && !outside; i++) {
+                const float CX = bx + (A[i] > 0 ? HALFSPACE_BLOCK-1 : 0);
+                const float CY = by + (B[i] > 0 ? HALFSPACE_BLOCK-1 : 0);
+                outside = A[i]*CX + B[i]*CY + C[i] < 0;
+            }
+            if (outside) continue;
+
+            // 2x2 pixels at a time
+            for (int y = by; y < by + HALFSPACE_BLOCK && y <= yend; y += 2) {
+                for (int x = bx; x < bx + HALFSPACE_BLOCK && x <= xend; x += 2) {
+                    int mask; // Bit per lane that is covered and passes the depth test
+#ifdef __SSE2__
+                    const __m128 PX = _mm_add_ps(_mm_set1_ps(x), LANE_X);
+                    const __m128 PY = _mm_add_ps(_mm_set1_ps(y), LANE_Y);
+
+                    // Coverage
+                    __m128 covered = _mm_and_ps(_mm_cmplt_ps(PX, _mm_set1_ps(XHI)), _mm_cmplt_ps(PY, _mm_set1_ps(YHI)));
+                    for (int i = 0; i < 3; i++) {
+                        const __m128 E = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(A[i]), PX), _mm_mul_ps(_mm_set1_ps(B[i]), PY)), _mm_set1_ps(C[i]));
+                        covered = _mm_and_ps(covered, inclusive[i] ? _mm_cmpge_ps(E, ZERO) : _mm_cmpgt_ps(E, ZERO));
+                    }
+                    if (!_mm_movemask_ps(covered)) continue;
+
+                    // Depth (uncovered lanes and lanes off the edge of the area are given a depth nothing can pass)
+                    // (added up in the same order as the interpolation below, so the depth prepass sees the same z as fragment())
+                    const __m128 Z = _mm_add_ps(_mm_add_ps(_mm_set1_ps(v0.coord[2]),
+                                                           _mm_mul_ps(_mm_sub_ps(PX, _mm_set1_ps(X0)), _mm_set1_ps(dadx.coord[2]))),
+                                                _mm_mul_ps(_mm_sub_ps(PY, _mm_set1_ps(Y0)), _mm_set1_ps(dady.coord[2])));
+                    // (fixed point formats leave the depth test to fragment(), it has to quantize first)
+                    float lane_z[4], depth[4];
+                    _mm_storeu_ps(lane_z, Z);
+                    const int COVERED = _mm_movemask_ps(covered);
+                    for (int lane = 0; lane < 4; lane++) {
+                        const int LX = x + (lane & 1), LY = y + (lane >> 1);
+                        depth[lane] = !(COVERED & 1 << lane && LX < XHI && LY < YHI) ? NEVER_PASSES
+                                    : EXACT_DEPTH ? z_buffer.read(LY*display_xSize + LX, lane_z[lane], tile ? tile->depth_reads : depth_reads)
+                                    : ALWAYS_PASSES;
+                    }
+                    const __m128 DEPTH = _mm_loadu_ps(depth);
+                    mask = _mm_movemask_ps(_mm_and_ps(covered, REVERSED ? _mm_cmpge_ps(Z, DEPTH) : _mm_cmple_ps(Z, DEPTH)));
+                    if (!tile || tile->pass != PASS_DEPTH_ONLY) // Hidden lanes never make it to fragment(), count them here
+                        (tile ? tile->fragments_rejected : fragments_rejected) += __builtin_popcount(COVERED) - __builtin_popcount(mask);
+#else
+                    mask = 0;
+                    for (int lane = 0; lane < 4; lane++) {
+                        const int LX = x + (lane & 1), LY = y + (lane >> 1);
+                        if (LX >= XHI || LY >= YHI) continue;
+                        bool covered = true;
+                        for (int i = 0; i < 3; i++) {
+                            const float E = A[i]*LX + B[i]*LY + C[i];
+                            covered = covered && (inclusive[i] ? E >= 0 : E > 0);
+                        }
+                        const float Z = z_buffer.quantize(v0.coord[2] + (LX - X0)*dadx.coord[2] + (LY - Y0)*dady.coord[2]);
+                        if (covered && z_buffer.passes(Z, z_buffer.read(LY*display_xSize + LX, Z, tile ? tile->depth_reads : depth_reads)))
+                            mask |= 1 << lane;
+                        else if (covered && (!tile || tile->pass != PASS_DEPTH_ONLY)) // Same as above
+                            (tile ? tile->fragments_rejected : fragments_rejected)++;
+                    }
+#endif
+
+                    // Interpolate, shade and plot what's left
+                    for (int lane = 0; mask; lane++, mask >>= 1) {
+                        if (!(mask & 1)) continue;
+                        const int LX = x + (lane & 1), LY = y + (lane >> 1);
+
+                        attr_point value; // value = v0 + (x-X0)*dadx + (y-Y0)*dady
+                        for (int i : attr_slots<FORMAT>::SLOT)
+                            value.coord[i] = v0.coord[i] + (LX - X0)*dadx.coord[i] + (LY - Y0)*dady.coord[i];
+
+                        fragment<FORMAT, SHADER>(LX, LY, value, tile);
+                    }
+                }
             }
         }
+    }
+}
+
+// Sends a clipped polygon in device space to the selected rasterizer
+template <int FORMAT, int SHADER>
+void REDirect::rasterize_kernel(const attr_point* points, int count, EdgePool& pool, Tile* tile) {
+    if (halfspace_rasterizer && count == 3)
+        halfspace_triangle<FORMAT, SHADER>(points, tile);
+    else {
+        scan_conversion<FORMAT, SHADER>(points, count, pool, tile, *this);
+        if (stats) (tile ? tile->stage : stage).edges += pool.edges.size();
+    }
 
-        p1 = p2->next;
+    if (span_shading)
+        flush_span((shader_kind)SHADER, tile); // The rest of this polygon's fragments
+}
+
+// Shades everything in pending_span at once, then plots it
+void REDirect::flush_span(shader_kind shader, Tile* tile) {
+    span_batch& batch = pending_span;
+    if (!batch.fragments.count) return;
+
+    // The shading globals of this polygon
+    span_material material;
+    material.model = shader == SHADER_METAL ? SPAN_METAL : shader == SHADER_PLASTIC ? SPAN_PLASTIC : SPAN_MATTE;
+    memcpy(material.surface_color, surface_color, sizeof surface_color);
+    memcpy(material.specular_color, specular_color, sizeof specular_color);
+    get_ambience(material.ambience);
+    material.diffuse_coefficient  = diffuse_coefficient;
+    material.specular_coefficient = specular_coefficient;
+    material.specular_exponent    = specular_exponent;
+    camera_eye_position.into_array(material.eye);
+
+    shade_span(light_arrays, material, batch.fragments);
+
+    long& shaded  = tile ? tile->fragments_shaded  : fragments_shaded;
+    long& plotted = tile ? tile->fragments_written : fragments_written;
+    for (int i = 0; i < batch.fragments.count; i++) {
+        const float color[3] = {batch.fragments.r[i], batch.fragments.g[i], batch.fragments.b[i]};
+        shaded++;
+        if (tile ? plot(*tile, batch.x[i], batch.y[i], batch.z[i], color) : plot(batch.x[i], batch.y[i], batch.z[i], color))
+            plotted++;
     }
+    batch.fragments.count = 0;
 }
 
+// Picks the span kernel once per polygon, from the pass, the vertex flags and the surface shader
+// (in tiled mode the polygon's shading state is already loaded by now)
+void REDirect::rasterize(const attr_point* points, int count, EdgePool& pool, Tile* tile) {
+    typedef void (REDirect::*kernel)(const attr_point*, int, EdgePool&, Tile*);
+#define KERNELS_FOR(FORMAT) { &REDirect::rasterize_kernel<FORMAT, SHADER_MATTE>,   &REDirect::rasterize_kernel<FORMAT, SHADER_METAL>, \
+                              &REDirect::rasterize_kernel<FORMAT, SHADER_PLASTIC>, &REDirect::rasterize_kernel<FORMAT, SHADER_OTHER> }
+    static const kernel KERNELS[ATTRS_COUNT][SHADER_COUNT] = { KERNELS_FOR(ATTRS_DEPTH), KERNELS_FOR(ATTRS_FLAT), KERNELS_FOR(ATTRS_SMOOTH) };
+#undef KERNELS_FOR
+
+    attr_format format = ATTRS_FLAT;
+    if (tile && tile->pass == PASS_DEPTH_ONLY)
+        format = ATTRS_DEPTH; // Nothing gets shaded
+    else if (vertex_interpolation_flag && _vertex_normal_flag)
+        format = ATTRS_SMOOTH; // Same test as get_surface_normal()
+
+    shader_kind shader = SHADER_OTHER;
+    if      (surface_shader == &matte)   shader = SHADER_MATTE;
+    else if (surface_shader == &metal)   shader = SHADER_METAL;
+    else if (surface_shader == &plastic) shader = SHADER_PLASTIC;
+
+    stage_stats& counts = tile ? tile->stage : stage;
+    if (stats) counts.polygons_rasterized++;
+    stage_timer timer(stats, counts.raster_time);
+    (this->*KERNELS[format][shader])(points, count, pool, tile);
+}
 
 // Polygon Pipeline
 void REDirect::polygon_pipeline(float x, float y, float z) {
@@ -1060,13 +1525,24 @@ void REDirect::polygon_pipeline(Vector3 v) {
     polygon_pipeline(v, false);
 }
 void REDirect::polygon_pipeline(Vector3 v, bool finish_and_draw) {
-    // MOVE (add to queue in clip coords)
-    Point4 p = Point4(v);
-    current_transform.multiply_mutate(p); // Object to World
+    pp_points.push_back(polygon_vertex(v)); // Add to list in clip coordinates
+    if (finish_and_draw) polygon_draw(false);
+}
+
+// MOVE (the attributed point of v in clip coords)
+attr_point REDirect::polygon_vertex(const Vector3& v) {
+    if (stats) stage.vertices++;
+    Point4 world = Point4(v);
+    current_transform.multiply_mutate(world); // Object to World
+    Point4 clip = world;
+    world_to_clip_transform.multiply_mutate(clip); // World to Camera AND Camera to Clip
+    return polygon_vertex(world, clip);
+}
 
+// Same with the point already transformed (rd_polyset does all of them at once)
+attr_point REDirect::polygon_vertex(const Point4& p, const Point4& clip) {
     // Lighting Start
     attr_point a;
-    p.into_array(a.coord); // xyzw
 
     a.coord[ATTR_CONSTANT] = 1.0f; // Must be set to 1 (before clipping?)
 
@@ -1092,15 +1568,56 @@ void REDirect::polygon_pipeline(Vector3 v, bool finish_and_draw) {
     a.coord[ATTR_WORLD_Z] = p.z / p.w;
     // Lighting End
 
+    clip.into_array(a.coord); // xyzw in Clip Space
+    return a;
+}
 
-    // World to Camera AND Camera to Clip
-    world_to_clip_transform.multiply_mutate(p); 
-    p.into_array(a.coord); // update a.xyzw
-    pp_points.push_back(a); // Add to list in clip coordinates
-    if (!finish_and_draw) return; // Done with using a and p (and its namespace, so no problem if being reused for something else later on);
+// DRAW (everything in pp_points)
+// If the caller already knows every point is inside all the clipping boundaries, the clipper is skipped.
+void REDirect::polygon_draw(bool inside) {
+    stage_timer timer(stats, stage.pipeline_time);
+    if (stats) stage.polygons_submitted++;
 
-    // DRAW
-    if (polygon_clipping()) { // Check if not nothing clipped is in bounds (in Clip Space), otherwise theres something more to draw
+    // Back-face culling (before any of the clipping work)
+    if (!double_side && back_facing(pp_points)) {
+        if (stats) { polygons_backfacing++; stage.polygons_culled++; }
+        pp_points.clear();
+        return;
+    }
+
+    // Trivially accept or reject it with the outcodes if the caller hasn't
+    if (!inside) {
+        int any_outside = 0, all_outside = 0x3F;
+        for (const attr_point& p : pp_points) {
+            const int CODE = polygon_outcode(p);
+            any_outside |= CODE;
+            all_outside &= CODE;
+        }
+        inside = any_outside == 0;
+        if (all_outside) { // Every point is outside the same boundary, clipping would leave nothing
+            if (stats) stage.polygons_culled++;
+            pp_points.clear();
+            return;
+        }
+    }
+
+    // Inside the guard band but not on the screen at all
+    if (guard_band > 0 && polygon_off_screen(pp_points)) {
+        if (stats) stage.polygons_culled++;
+        pp_points.clear();
+        return;
+    }
+
+    if (inside)
+        pp_clipped.assign(pp_points.begin(), pp_points.end()); // Clipping would give back the same points
+    else {
+        stage_timer timer(stats, stage.clipping_time);
+        if (stats) stage.polygons_clipped++;
+        polygon_clipping();
+    }
+    if (stats && pp_clipped.empty()) stage.polygons_culled++; // Clipped away completely
+
+    if (!pp_clipped.empty()) { // Check if not nothing clipped is in bounds (in Clip Space), otherwise theres something more to draw
         // Pre process vertex list for conversion
         for (int i = 0, SIZE = pp_clipped.size(); i < SIZE; i++) {
             // Clip to Device
@@ -1118,6 +1635,16 @@ void REDirect::polygon_pipeline(Vector3 v, bool finish_and_draw) {
             pp_clipped[i] = a; // Redundant if a is passed from vector by reference
         }
 
+        // Hierarchical Z: skip the polygon if it's behind everything already drawn where it would go
+        // (binned polygons are tested in rasterize_tile(), the z_buffer isn't written until then)
+        if (occlusion_culling && tiles.empty() && polygon_occluded(pp_clipped.data(), pp_clipped.size())) {
+            polygons_occluded++;
+            if (stats) stage.polygons_culled++;
+            pp_points.clear();
+            pp_clipped.clear();
+            return;
+        }
+
         // Before the scan conversion routine is called, the global polygon normal, which is in object coordinates, needs to be converted to world coordinates. (already happened in all the shapes)
         // normal_transform.multiply_mutate(polygon_normal);
         if (!(vertex_interpolation_flag && _vertex_normal_flag)) { // If false, polygon_normal needs to be the normal of this polygon face
@@ -1162,7 +1689,10 @@ void REDirect::polygon_pipeline(Vector3 v, bool finish_and_draw) {
         }
 
         // Scan convert draw and fill color (in Device Space), then reset for the next polygon
-        scan_conversion(*this);
+        if (!tiles.empty())
+            bin_polygon(pp_clipped); // Or save it for the workers to draw later (tiled mode)
+        else
+            rasterize(pp_clipped.data(), pp_clipped.size(), edge_pool, nullptr);
     }
 
     pp_points.clear();
@@ -1170,6 +1700,505 @@ void REDirect::polygon_pipeline(Vector3 v, bool finish_and_draw) {
 }
 
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Culling
+// Back-face: with OptionBool "DoubleSide" off, polygons whose vertices go clockwise on the screen are facing away and never drawn.
+// Frustum: a sphere around each primitive call is checked against the 6 clipping planes before any of it is made.
+
+// Signed area (times 2) of the polygon in Device Space, counter-clockwise (front facing) is positive.
+// Only works if every point is in front of the eye (w > 0), otherwise the polygon is kept and left to the clipper.
+bool REDirect::back_facing(const std::vector<attr_point>& points) {
+    if (points.size() < 3) return false;
+
+    float area = 0.0f;
+    Vector3 last;
+    for (size_t i = 0, SIZE = points.size(); i <= SIZE; i++) {
+        const attr_point& a = points[i % SIZE];
+        if (a.coord[3] <= 0.0f) return false;
+
+        Point4 p = clip_to_device_transform.multiply(a.coord[0], a.coord[1], a.coord[2], a.coord[3]);
+        const Vector3 v = Vector3(p.x / p.w, p.y / p.w, 0);
+        if (i > 0) area += last.x*v.y - v.x*last.y;
+        last = v;
+    }
+    return area > 0.0f; // Device y goes down, so the sign is flipped from Clip Space
+}
+
+// Each clipping boundary (0 <= x,y,z <= w) is a plane in Clip Space, made into Object Space with the rows of (World to Clip * Object to World).
+// The sphere is outside if its center is farther than the radius on the outside of any of them.
+bool REDirect::sphere_outside_frustum(const Vector3& center, float radius) {
+    const Matrix4& M = object_to_clip();
+    const float X[4] = {M.xx, M.xy, M.xz, M.xw};
+    const float Y[4] = {M.yx, M.yy, M.yz, M.yw};
+    const float Z[4] = {M.zx, M.zy, M.zz, M.zw};
+    const float W[4] = {M.wx, M.wy, M.wz, M.ww};
+
+    for (int b = 0; b < 6; b++) {
+        float plane[4];
+        for (int i = 0; i < 4; i++) {
+            switch (b) {
+            case 0: plane[i] =        X[i]; break; // Left   (  x)
+            case 1: plane[i] = W[i] - X[i]; break; // Right  (w-x)
+            case 2: plane[i] =        Y[i]; break; // Bottom (  y)
+            case 3: plane[i] = W[i] - Y[i]; break; // Top    (w-y)
+            case 4: plane[i] =        Z[i]; break; // Back   (  z)
+            case 5: plane[i] = W[i] - Z[i]; break; // Front  (w-z)
+            }
+        }
+
+        const float LENGTH = std::sqrt(plane[0]*plane[0] + plane[1]*plane[1] + plane[2]*plane[2]);
+        const float DISTANCE = plane[0]*center.x + plane[1]*center.y + plane[2]*center.z + plane[3];
+        if (DISTANCE < -radius*LENGTH) {
+            if (stats) primitives_outside++;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Hierarchical Z (OptionBool "OcclusionCulling")
+// Level 0 holds the farthest depth of every HIZ_SIZE x HIZ_SIZE block of the z_buffer, level 1 the farthest of every HIZ_SIZE x HIZ_SIZE group of level 0 blocks.
+// Writing to the z_buffer only marks the blocks dirty (the farthest depth can go down, not just up), they're found again when tested.
+// If the closest depth of a polygon is farther than the farthest depth of every block under it, every pixel would fail the depth test.
+
+void REDirect::depth_written(int x, int y) {
+    if (!occlusion_culling) return;
+    hiz_dirty[0][(y / HIZ_SIZE)*hiz_w[0] + x / HIZ_SIZE] = true;
+    hiz_dirty[1][(y / (HIZ_SIZE*HIZ_SIZE))*hiz_w[1] + x / (HIZ_SIZE*HIZ_SIZE)] = true;
+}
+
+float REDirect::hiz_max(int level, int bx, int by) {
+    const int i = by*hiz_w[level] + bx;
+    if (!hiz_dirty[level][i]) return hiz[level][i];
+
+    float farthest = z_buffer.closest();
+    if (level == 0) { // From the z_buffer
+        const int XEND = std::min((bx+1)*HIZ_SIZE, display_xSize), YEND = std::min((by+1)*HIZ_SIZE, display_ySize);
+        for (int y = by*HIZ_SIZE; y < YEND; y++)
+            for (int x = bx*HIZ_SIZE; x < XEND; x++)
+                farthest = z_buffer.farther(farthest, z_buffer.read(y*display_xSize + x));
+    } else { // From level 0
+        const int XEND = std::min((bx+1)*HIZ_SIZE, hiz_w[0]), YEND = std::min((by+1)*HIZ_SIZE, hiz_h[0]);
+        for (int y = by*HIZ_SIZE; y < YEND; y++)
+            for (int x = bx*HIZ_SIZE; x < XEND; x++)
+                farthest = z_buffer.farther(farthest, hiz_max(0, x, y));
+    }
+
+    hiz[level][i] = farthest;
+    hiz_dirty[level][i] = false;
+    return farthest;
+}
+
+bool REDirect::occluded(float xmin, float ymin, float xmax, float ymax, float zmin, const Tile* tile) {
+    // Pixels that could be touched (clamped to the screen or the tile, as floats first since the guard band can go past what an int holds)
+    const float XLO = tile ? tile->x0 : 0, XHI = (tile ? tile->x1 : display_xSize) - 1;
+    const float YLO = tile ? tile->y0 : 0, YHI = (tile ? tile->y1 : display_ySize) - 1;
+    const float LEFT = std::max(XLO, std::floor(xmin)), RIGHT = std::min(XHI, std::ceil(xmax));
+    const float TOP = std::max(YLO, std::floor(ymin)), BOTTOM = std::min(YHI, std::ceil(ymax));
+    if (LEFT > RIGHT || TOP > BOTTOM) return false; // Off screen, not up to this to decide
+    const int X0 = LEFT, X1 = RIGHT, Y0 = TOP, Y1 = BOTTOM;
+
+    // Compared the same way fragment() does it, a fragment at zmin could tie with a stored depth once quantized
+    zmin = z_buffer.quantize(zmin);
+
+    const int COARSE = HIZ_SIZE*HIZ_SIZE;
+    for (int cy = Y0 / COARSE; cy <= Y1 / COARSE; cy++) {
+        for (int cx = X0 / COARSE; cx <= X1 / COARSE; cx++) {
+            if (z_buffer.in_front(hiz_max(1, cx, cy), zmin)) continue; // Everything in this group is closer
+
+            // Check the blocks of the group that are under the rectangle
+            const int BX0 = std::max(X0 / HIZ_SIZE, cx*HIZ_SIZE), BX1 = std::min(X1 / HIZ_SIZE, (cx+1)*HIZ_SIZE - 1);
+            const int BY0 = std::max(Y0 / HIZ_SIZE, cy*HIZ_SIZE), BY1 = std::min(Y1 / HIZ_SIZE, (cy+1)*HIZ_SIZE - 1);
+            for (int by = BY0; by <= BY1; by++)
+                for (int bx = BX0; bx <= BX1; bx++)
+                    if (!z_buffer.in_front(hiz_max(0, bx, by), zmin))
+                        return false; // Something here is farther, could be visible
+        }
+    }
+    return true;
+}
+
+bool REDirect::polygon_occluded(const attr_point* points, int count, const Tile* tile) {
+    // Screen bounding rectangle and closest depth (device space)
+    float xmin = points[0].coord[0], xmax = xmin;
+    float ymin = points[0].coord[1], ymax = ymin;
+    float zmin = points[0].coord[2];
+    for (int i = 1; i < count; i++) {
+        const attr_point& p = points[i];
+        xmin = std::min(xmin, p.coord[0]); xmax = std::max(xmax, p.coord[0]);
+        ymin = std::min(ymin, p.coord[1]); ymax = std::max(ymax, p.coord[1]);
+        zmin = z_buffer.closer(zmin, p.coord[2]);
+    }
+    return occluded(xmin, ymin, xmax, ymax, zmin, tile);
+}
+
+// Same idea as above for a whole primitive before any of it goes through polygon_pipeline,
+// using the 8 corners of a box around it in object space
+bool REDirect::box_occluded(const Vector3& min, const Vector3& max) {
+    float xmin = 0, ymin = 0, zmin = 0, xmax = 0, ymax = 0;
+    for (int corner = 0; corner < 8; corner++) {
+        Point4 p = Point4(corner & 1 ? max.x : min.x, corner & 2 ? max.y : min.y, corner & 4 ? max.z : min.z);
+        p = object_to_clip().multiply(p); // Object to Clip
+        if (p.w <= 0 || (z_buffer.reversed() ? p.z > p.w : p.z < 0)) return false; // Behind the eye or in front of the near plane, the rectangle below wouldn't hold
+        clip_to_device_transform.multiply_mutate(p); // Clip to Device
+
+        const float X = p.x/p.w, Y = p.y/p.w, Z = p.z/p.w;
+        if (corner == 0) {
+            xmin = xmax = X; ymin = ymax = Y; zmin = Z;
+        } else {
+            xmin = std::min(xmin, X); xmax = std::max(xmax, X);
+            ymin = std::min(ymin, Y); ymax = std::max(ymax, Y);
+            zmin = z_buffer.closer(zmin, Z);
+        }
+    }
+
+    if (!occluded(xmin, ymin, xmax, ymax, zmin)) return false;
+    primitives_occluded++;
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Tiled mode
+// Copies the shading globals of the calling thread into state (and back)
+static void save_shading_state(shading_state& state) {
+    state.shader = surface_shader;
+    memcpy(state.surface_color, surface_color, sizeof surface_color);
+    memcpy(state.specular_color, specular_color, sizeof specular_color);
+    state.specular_exponent = specular_exponent;
+    state.ambient_coefficient  = ambient_coefficient;
+    state.diffuse_coefficient  = diffuse_coefficient;
+    state.specular_coefficient = specular_coefficient;
+    state.vertex_color_flag   = _vertex_color_flag;
+    state.vertex_normal_flag  = _vertex_normal_flag;
+    state.vertex_texture_flag = _vertex_texture_flag;
+    state.vertex_interpolation_flag = vertex_interpolation_flag;
+    state.polygon_normal = polygon_normal;
+}
+static void load_shading_state(const shading_state& state) {
+    surface_shader = state.shader;
+    memcpy(surface_color, state.surface_color, sizeof surface_color);
+    memcpy(specular_color, state.specular_color, sizeof specular_color);
+    specular_exponent = state.specular_exponent;
+    ambient_coefficient  = state.ambient_coefficient;
+    diffuse_coefficient  = state.diffuse_coefficient;
+    specular_coefficient = state.specular_coefficient;
+    _vertex_color_flag   = state.vertex_color_flag;
+    _vertex_normal_flag  = state.vertex_normal_flag;
+    _vertex_texture_flag = state.vertex_texture_flag;
+    vertex_interpolation_flag = state.vertex_interpolation_flag;
+    polygon_normal = state.polygon_normal;
+}
+
+void REDirect::bin_polygon(const std::vector<attr_point>& points) {
+    // Save the polygon
+    binned_polygon polygon;
+    polygon.first = tiled_points.size();
+    polygon.count = points.size();
+    save_shading_state(polygon.state);
+    tiled_points.insert(tiled_points.end(), points.begin(), points.end());
+
+    // Screen bounding rectangle (device space)
+    float xmin = points[0].coord[0], xmax = xmin;
+    float ymin = points[0].coord[1], ymax = ymin;
+    for (const attr_point& p : points) {
+        xmin = std::min(xmin, p.coord[0]); xmax = std::max(xmax, p.coord[0]);
+        ymin = std::min(ymin, p.coord[1]); ymax = std::max(ymax, p.coord[1]);
+    }
+
+    // Tiles it touches (clamped to the screen while still floats, the guard band can leave it far enough outside to overflow an int)
+    const float XMAX = display_xSize - 1, YMAX = display_ySize - 1;
+    const int TX0 = (int)std::min(std::max(xmin, 0.0f), XMAX) / TILE_SIZE, TX1 = (int)std::min(std::max(xmax, 0.0f), XMAX) / TILE_SIZE;
+    const int TY0 = (int)std::min(std::max(ymin, 0.0f), YMAX) / TILE_SIZE, TY1 = (int)std::min(std::max(ymax, 0.0f), YMAX) / TILE_SIZE;
+
+    const int INDEX = binned_polygons.size();
+    binned_polygons.push_back(polygon);
+    for (int ty = TY0; ty <= TY1; ty++)
+        for (int tx = TX0; tx <= TX1; tx++)
+            tiles[ty*tiles_x + tx].polygons.push_back(INDEX);
+}
+
+void REDirect::rasterize_tile(Tile& tile, EdgePool& pool) {
+    // Hierarchical Z in the tile: skip polygons behind everything drawn in it so far
+    // (after a depth prepass that's the final depths, so nothing that's skipped could have matched one)
+    auto occluded_here = [&](const binned_polygon& polygon) {
+        if (!occlusion_culling || !polygon_occluded(&tiled_points[polygon.first], polygon.count, &tile)) return false;
+        tile.polygons_occluded++;
+        if (stats) tile.stage.polygons_culled++;
+        return true;
+    };
+
+    // Depth prepass: Find the closest depth of every pixel first, without shading
+    if (depth_prepass) {
+        tile.pass = PASS_DEPTH_ONLY;
+        for (int i : tile.polygons) {
+            if (i < 0) continue; // Points and lines only get drawn with the shading
+            const binned_polygon& polygon = binned_polygons[i];
+            if (occluded_here(polygon)) continue;
+            rasterize(&tiled_points[polygon.first], polygon.count, pool, &tile);
+        }
+    }
+
+    // Then shade (only what matches those depths if there was a prepass)
+    tile.pass = depth_prepass ? PASS_SHADE_EQUAL : PASS_NORMAL;
+    for (int i : tile.polygons) {
+        if (i < 0) { // A point or line pixel (retained mode)
+            const deferred_fragment& f = deferred_fragments[-1 - i];
+            plot(tile, f.x, f.y, f.z, f.color);
+            continue;
+        }
+        const binned_polygon& polygon = binned_polygons[i];
+        if (occluded_here(polygon)) continue;
+        load_shading_state(polygon.state); // This thread's shading globals become the polygon's
+        rasterize(&tiled_points[polygon.first], polygon.count, pool, &tile);
+    }
+}
+
+// The workers used to be started and joined on every flush, and points, lines, lights, fills and option changes all flush.
+// Now they wait on workers.wake between jobs.
+void REDirect::run_workers(int count, const std::function<void(EdgePool&)>& job) {
+    if ((int)workers.threads.size() != count - 1) { // First time, or OptionReal "Threads" changed
+        stop_workers();
+        workers.quit = false;
+        for (int i = 1; i < count; i++) {
+            workers.threads.push_back(std::thread([this, seen = workers.generation]() mutable {
+                EdgePool pool; // Each worker needs its own edge pool
+                std::unique_lock<std::mutex> lock(workers.lock);
+                for (;;) {
+                    workers.wake.wait(lock, [&]() { return workers.quit || workers.generation != seen; });
+                    if (workers.quit) return;
+                    seen = workers.generation;
+                    lock.unlock();
+                    (*workers.job)(pool);
+                    lock.lock();
+                    if (--workers.busy == 0)
+                        workers.done.notify_one();
+                }
+            }));
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(workers.lock);
+        workers.job = &job;
+        workers.busy = workers.threads.size();
+        workers.generation++;
+    }
+    workers.wake.notify_all();
+    job(edge_pool);
+
+    std::unique_lock<std::mutex> lock(workers.lock);
+    workers.done.wait(lock, [&]() { return workers.busy == 0; });
+    workers.job = nullptr;
+}
+
+void REDirect::stop_workers() {
+    {
+        std::lock_guard<std::mutex> lock(workers.lock);
+        workers.quit = true;
+    }
+    workers.wake.notify_all();
+    for (std::thread& t : workers.threads)
+        t.join();
+    workers.threads.clear();
+}
+
+void REDirect::flush_tiles(bool frame_end) {
+    // Nothing to draw (also the case if not in tiled mode), but retained mode still has to look at every tile at the end of the frame
+    if (binned_polygons.empty() && deferred_fragments.empty() && !(retained_frame && frame_end)) return;
+
+    // Retained mode: tiles can only be reused (or saved for the next frame) at the end of a frame that never got flushed before,
+    // and last frame has to have been saved
+    if (retained_frame && !frame_end)
+        retained_flushed = true; // Part of this frame is already drawn, what's left in the tiles isn't all of it
+    if (retained_flushed)
+        retained_valid = false;
+    const bool RETAINED = retained_frame && frame_end && !retained_flushed;
+    bool reuse = false;
+    uint64_t frame = 0;
+    if (RETAINED) {
+        const size_t PIXELS = (size_t)display_xSize * display_ySize;
+        reuse = retained_valid && retained_hash.size() == tiles.size() && retained_depth.size() == PIXELS;
+        if (!reuse) {
+            retained_hash.assign(tiles.size(), 0);
+            retained_color.assign(PIXELS*3, 0.0f);
+            retained_depth.assign(PIXELS, z_buffer.farthest());
+            retained_written.assign(PIXELS, false);
+        }
+        frame = frame_hash();
+    }
+
+    shading_state saved; // The main thread is also a worker, so remember where it was
+    save_shading_state(saved);
+
+    // Workers grab the next undrawn tile until there are none left
+    std::atomic<int> next_tile(0);
+    const std::function<void(EdgePool&)> worker = [&](EdgePool& pool) {
+        for (int t; (t = next_tile++) < (int)tiles.size();) {
+            Tile& tile = tiles[t];
+            if (RETAINED) {
+                tile.hash = tile_hash(tile, frame);
+                tile.reused = reuse && tile.hash == retained_hash[t];
+                retained_hash[t] = tile.hash;
+                if (tile.reused) { // Nothing in it changed
+                    reuse_tile(tile);
+                    continue;
+                }
+            }
+            if (!tile.polygons.empty())
+                rasterize_tile(tile, pool);
+            if (RETAINED)
+                retain_tile(tile);
+        }
+    };
+
+    int threads = tile_threads > 0 ? tile_threads : std::thread::hardware_concurrency();
+    threads = std::max(1, std::min(threads, (int)tiles.size()));
+    run_workers(threads, worker);
+
+    // Write the tiles back to the display (only from this thread, the display drivers aren't thread safe)
+    for (Tile& tile : tiles) {
+        if (tile.reused) { // Last frame's pixels instead (same spans as below)
+            for (int y = tile.y0; y < tile.y1; y++) {
+                const int ROW = y*display_xSize;
+                for (int x = tile.x0; x < tile.x1; x++) {
+                    if (!retained_written[ROW + x]) continue;
+                    const int START = x;
+                    while (x < tile.x1 && retained_written[ROW + x]) x++;
+                    rd_write_span(y, START, x, &retained_color[(ROW + START)*3]);
+                }
+            }
+            tile.reused = false;
+            tile.polygons.clear();
+            tiles_reused++;
+            continue;
+        }
+        if (tile.polygons.empty()) continue;
+        // One rd_write_span() for each run of written pixels in a row
+        const int WIDTH = tile.x1 - tile.x0;
+        for (int y = tile.y0; y < tile.y1; y++) {
+            const int ROW = (y - tile.y0)*WIDTH;
+            for (int x = 0; x < WIDTH; x++) {
+                if (!tile.written[ROW + x]) continue;
+                const int START = x;
+                while (x < WIDTH && tile.written[ROW + x])
+                    tile.written[ROW + x++] = false;
+                rd_write_span(y, tile.x0 + START, tile.x0 + x, &tile.color[(ROW + START)*3]);
+            }
+        }
+        tile.polygons.clear();
+
+        fragments_rejected += tile.fragments_rejected;
+        fragments_shaded += tile.fragments_shaded;
+        fragments_written += tile.fragments_written;
+        depth_reads += tile.depth_reads;
+        depth_writes += tile.depth_writes;
+        polygons_occluded += tile.polygons_occluded;
+        tile.fragments_rejected = tile.fragments_shaded = tile.fragments_written = 0;
+        tile.depth_reads = tile.depth_writes = tile.polygons_occluded = 0;
+        stage.add(tile.stage);
+        tile.stage.clear();
+    }
+
+    binned_polygons.clear();
+    tiled_points.clear();
+    deferred_fragments.clear();
+    load_shading_state(saved);
+    if (RETAINED) retained_valid = true; // Next frame can reuse this one
+}
+
+// 64 bit FNV-1a
+static inline uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+template <typename T> static inline uint64_t hash_value(uint64_t hash, const T& value) {
+    return hash_bytes(hash, &value, sizeof value);
+}
+
+uint64_t REDirect::frame_hash() {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = hash_value(hash, display_xSize);
+    hash = hash_value(hash, display_ySize);
+    hash = hash_value(hash, z_buffer.format);
+    hash = hash_bytes(hash, background, sizeof background);
+    hash = hash_bytes(hash, ambient_light, sizeof ambient_light);
+    for (const std::vector<light_data>* lights : {&far_lights, &point_lights})
+        for (const light_data& light : *lights) {
+            hash = hash_bytes(hash, light.rgb, sizeof light.rgb);
+            hash = hash_value(hash, light.xyz.x); hash = hash_value(hash, light.xyz.y); hash = hash_value(hash, light.xyz.z);
+        }
+    hash = hash_value(hash, camera_eye_position.x); // Specular
+    hash = hash_value(hash, camera_eye_position.y);
+    hash = hash_value(hash, camera_eye_position.z);
+    hash = hash_value(hash, halfspace_rasterizer); // These can move pixels around a little
+    hash = hash_value(hash, span_shading);
+    hash = hash_value(hash, depth_prepass);
+    return hash;
+}
+
+// Every polygon (its device space points and shading state) and point or line pixel in the tile, in order
+uint64_t REDirect::tile_hash(const Tile& tile, uint64_t hash) {
+    for (int i : tile.polygons) {
+        if (i < 0) {
+            const deferred_fragment& f = deferred_fragments[-1 - i];
+            hash = hash_value(hash, f.x); hash = hash_value(hash, f.y);
+            hash = hash_value(hash, f.z); hash = hash_bytes(hash, f.color, sizeof f.color);
+            continue;
+        }
+        const binned_polygon& polygon = binned_polygons[i];
+        const shading_state& s = polygon.state;
+        hash = hash_value(hash, s.shader);
+        hash = hash_bytes(hash, s.surface_color, sizeof s.surface_color);
+        hash = hash_bytes(hash, s.specular_color, sizeof s.specular_color);
+        hash = hash_value(hash, s.specular_exponent);
+        hash = hash_value(hash, s.ambient_coefficient); hash = hash_value(hash, s.diffuse_coefficient); hash = hash_value(hash, s.specular_coefficient);
+        hash = hash_value(hash, s.vertex_color_flag); hash = hash_value(hash, s.vertex_normal_flag);
+        hash = hash_value(hash, s.vertex_texture_flag); hash = hash_value(hash, s.vertex_interpolation_flag);
+        hash = hash_value(hash, s.polygon_normal.x); hash = hash_value(hash, s.polygon_normal.y); hash = hash_value(hash, s.polygon_normal.z);
+        hash = hash_value(hash, polygon.count);
+        for (int v = 0; v < polygon.count; v++) {
+            const attr_point& a = tiled_points[polygon.first + v];
+            for (int c = 0; c < ATTR_SIZE; c++)
+                if (s.vertex_normal_flag || c < ATTR_NX || c > ATTR_NZ) // Normals are left as garbage without the flag
+                    hash = hash_value(hash, a.coord[c]);
+        }
+    }
+    return hash;
+}
+
+// Only the worker that has the tile touches its slice of the z_buffer
+void REDirect::reuse_tile(Tile& tile) {
+    for (int y = tile.y0; y < tile.y1; y++)
+        for (int x = tile.x0; x < tile.x1; x++)
+            z_buffer.write(y*display_xSize + x, retained_depth[y*display_xSize + x]);
+    for (int y = tile.y0; y < tile.y1; y += HIZ_SIZE) // Its hierarchical Z blocks have to be found again
+        for (int x = tile.x0; x < tile.x1; x += HIZ_SIZE)
+            depth_written(x, y);
+}
+
+void REDirect::retain_tile(Tile& tile) {
+    const int WIDTH = tile.x1 - tile.x0;
+    for (int y = tile.y0; y < tile.y1; y++)
+        for (int x = tile.x0; x < tile.x1; x++) {
+            const int PIXEL = y*display_xSize + x, I = (y - tile.y0)*WIDTH + (x - tile.x0);
+            retained_written[PIXEL] = tile.written[I];
+            retained_depth[PIXEL] = z_buffer.read(PIXEL);
+            if (tile.written[I])
+                memcpy(&retained_color[PIXEL*3], &tile.color[I*3], 3*sizeof(float));
+        }
+}
+
+
 // (3D) Line drawing
 // Takes two points, converts them into homogeneous points 
 // and passes them to the line pipeline one at a time, 
@@ -1219,6 +2248,7 @@ void draw_circle_pixels(int xC, int yC, int radius, const float current_color[3]
 
 // 2D Circle drawing
 int REDirect::rd_circle(const float center[3], float radius) {
+    flush_tiles();
     draw_circle_pixels(center[0], center[1], radius, current_color);
     return RD_OK;
 }
@@ -1263,9 +2293,110 @@ void search_for_spans_and_stack(int xS, int xE, int y, float seedColor[3], std::
     }
 }
 
+// Packed flood fill (when the display has display_pixels)
+// Same scanline fill as above, but reads the RGB24 rows directly instead of going through rd_read_pixel and comparing floats.
+// Pixels are compared to the seed color as bytes, 16 pixels (48 bytes) at a time with SSE,
+// and each span is filled with memset (gray) or by doubling memcpy's of the first pixel.
+// (Bytes equal is the same as floats equal, the byte to float conversion doesn't map two bytes to the same float)
+
+#define FILL_RUN 16 // Pixels compared at once
+static const uint64_t FILL_PIXELS = 0x249249249249ull;          // The first byte of every pixel in a run (every 3rd bit)
+
+// The seed color repeated for a whole run, so a run can be compared in one go
+struct fill_key {
+    unsigned char rgb[3*FILL_RUN];
+    fill_key(const unsigned char seed[3]) { for (int i = 0; i < 3*FILL_RUN; i++) rgb[i] = seed[i % 3]; }
+    bool matches(const unsigned char* pixel) const { return pixel[0] == rgb[0] && pixel[1] == rgb[1] && pixel[2] == rgb[2]; }
+};
+
+// Which pixels of the run starting at pixel match the key (bit 3*i set if pixel i does)
+static inline uint64_t fill_matches(const unsigned char* pixel, const fill_key& key) {
+    uint64_t bytes = 0;
+#ifdef __SSE2__
+    for (int i = 0; i < 3; i++) {
+        const __m128i EQUAL = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(pixel + 16*i)),
+                                             _mm_loadu_si128((const __m128i*)(key.rgb + 16*i)));
+        bytes |= (uint64_t)(unsigned)_mm_movemask_epi8(EQUAL) << 16*i;
+    }
+#else
+    for (int i = 0; i < 3*FILL_RUN; i++)
+        bytes |= (uint64_t)(pixel[i] == key.rgb[i]) << i;
+#endif
+    return bytes & (bytes >> 1) & (bytes >> 2) & FILL_PIXELS; // All 3 bytes of a pixel
+}
+
+// First x from x to end (not including) where the pixel does (match = true) or doesn't (false) match the key, or end if none
+static int fill_scan_right(const unsigned char* row, int x, int end, const fill_key& key, bool match) {
+    for (; x + FILL_RUN <= end; x += FILL_RUN) {
+        const uint64_t FOUND = match ? fill_matches(row + 3*x, key) : ~fill_matches(row + 3*x, key) & FILL_PIXELS;
+        if (FOUND) return x + __builtin_ctzll(FOUND) / 3;
+    }
+    for (; x < end && key.matches(row + 3*x) != match; x++);
+    return x;
+}
+
+// First x from x down to 0 where the pixel doesn't match the key, or -1 if they all do
+static int fill_scan_left(const unsigned char* row, int x, const fill_key& key) {
+    for (; x - (FILL_RUN-1) >= 0; x -= FILL_RUN) {
+        const uint64_t FOUND = ~fill_matches(row + 3*(x - (FILL_RUN-1)), key) & FILL_PIXELS;
+        if (FOUND) return x - (FILL_RUN-1) + (63 - __builtin_clzll(FOUND)) / 3;
+    }
+    for (; x >= 0 && key.matches(row + 3*x); x--);
+    return x;
+}
+
+// Sets pixels xS to xE (not including) of row to rgb
+static void fill_row(unsigned char* row, int xS, int xE, const unsigned char rgb[3]) {
+    unsigned char* pixels = row + 3*xS;
+    const size_t SIZE = 3 * (size_t)(xE - xS);
+    if (SIZE == 0) return;
+    if (rgb[0] == rgb[1] && rgb[1] == rgb[2]) { // Gray, every byte is the same
+        std::memset(pixels, rgb[0], SIZE);
+        return;
+    }
+    pixels[0] = rgb[0]; pixels[1] = rgb[1]; pixels[2] = rgb[2];
+    for (size_t done = 3; done < SIZE; done *= 2) // Copy what's filled so far after itself
+        std::memcpy(pixels + done, pixels, std::min(done, SIZE - done));
+}
+
+// Packed version of search_for_spans_and_stack: every run of seed colored pixels in row y touching xS to xE (not including) gets stacked
+static void search_packed_spans_and_stack(int xS, int xE, int y, const fill_key& key, std::stack<int>& stack) {
+    if (y < 0 || y >= display_ySize) return;
+    const unsigned char* row = display_pixels + (size_t)y * display_xSize * 3;
+
+    for (int x = fill_scan_right(row, xS, xE, key, true); x < xE; x = fill_scan_right(row, x, xE, key, true)) {
+        const int START = x == xS ? fill_scan_left(row, x, key) + 1 : x; // Only the first run can reach further left
+        x = fill_scan_right(row, x + 1, display_xSize, key, false);       // Any of them can reach further right
+        stack.push(START);
+        stack.push(x);
+        stack.push(y);
+    }
+}
+
+// Flood fills from (x, y) (on screen) with rgb straight in display_pixels
+static void fill_packed(int x, int y, const float rgb[3]) {
+    const size_t ROW_SIZE = (size_t)display_xSize * 3;
+    const fill_key KEY(display_pixels + y*ROW_SIZE + x*3);
+    const unsigned char COLOR[3] = {rd_color_byte(rgb[0]), rd_color_byte(rgb[1]), rd_color_byte(rgb[2])};
+
+    std::stack<int> stack = std::stack<int>(); // Push Order: xS, xE, y
+    search_packed_spans_and_stack(x, x + 1, y, KEY, stack);
+
+    while (!stack.empty()) {
+        y = stack.top(); stack.pop();
+        const int xE = stack.top(); stack.pop();
+        const int xS = stack.top(); stack.pop();
+
+        fill_row(display_pixels + y*ROW_SIZE, xS, xE, COLOR);
+        search_packed_spans_and_stack(xS, xE, y+1, KEY, stack);
+        search_packed_spans_and_stack(xS, xE, y-1, KEY, stack);
+    }
+}
+
 // Optimize early return if color is the same?
 // (2D) Flood fills the area from the seed point with the current drawing color
 int REDirect::rd_fill(const float seed_point[3]) {
+    flush_tiles(); // Needs to read what's actually been drawn
     int x = seed_point[0];
     int y = seed_point[1];
     float seedColor[3];
@@ -1277,6 +2408,12 @@ int REDirect::rd_fill(const float seed_point[3]) {
      && (.039f > std::abs(current_color[2] - seedColor[2])))
         return RD_OK;
 
+    // Straight in the framebuffer if there is one
+    if (display_pixels && x >= 0 && x < display_xSize && y >= 0 && y < display_ySize) {
+        fill_packed(x, y, current_color);
+        return RD_OK;
+    }
+
     // Check current span
     int xS = x, xE = x;
     if (y >= 0 && y < display_ySize && read_and_compare_rgb(x,y,seedColor)) { // Check start
@@ -1339,11 +2476,34 @@ int REDirect::rd_clipping(float znear, float zfar) {
 
 
 /**********************   Transformations **********************************/
+// The products of the transforms are only multiplied out again when they're needed after a change,
+// so a run of Translate/Scale/Rotate calls (or a Push/Pop around an object) costs nothing until something is drawn.
+void REDirect::transform_changed() {
+    object_to_clip_dirty = true;
+    normal_dirty = true;
+}
+
+const Matrix4& REDirect::object_to_clip() {
+    if (object_to_clip_dirty) {
+        object_to_clip_cache = world_to_clip_transform.multiply(current_transform);
+        object_to_clip_dirty = false;
+    }
+    return object_to_clip_cache;
+}
+
+const Matrix4& REDirect::normal_transform() {
+    if (normal_dirty) {
+        normal_cache = current_transform.normal_matrix();
+        normal_dirty = false;
+    }
+    return normal_cache;
+}
+
 // Takes an array of three floats, creates a translation matrix and multiplies it by the current transform, 
 // storing the result back in the current transform.
 int REDirect::rd_translate(const float offset[3]) {
     current_transform.translate_mutate(offset[0],offset[1],offset[2]);
-    // doesnt affect normal direction, so no worries about normal_transform
+    transform_changed();
     return RD_OK;
 }
 
@@ -1351,7 +2511,7 @@ int REDirect::rd_translate(const float offset[3]) {
 // storing the result back in the current transform.
 int REDirect::rd_scale(const float scale_factor[3]) {
     current_transform.scale_mutate(scale_factor[0],scale_factor[1],scale_factor[2]);
-    normal_transform.scale_mutate(1.f/scale_factor[0], 1.f/scale_factor[1], 1.f/scale_factor[2]); // Inverse transpose scale
+    transform_changed();
     return RD_OK;
 }
 
@@ -1359,21 +2519,21 @@ int REDirect::rd_scale(const float scale_factor[3]) {
 // The matrix is multiplied by the current transformation matrix and the results stored back in the current transform.
 int REDirect::rd_rotate_xy(float angle) {
     current_transform.rotate_xy_mutate(angle);
-    normal_transform.rotate_xy_mutate(angle); // Inverse transpose (cancels out for all axis-aligned rotations)
+    transform_changed();
     return RD_OK;
 }
 
 // Same but in the X-Axis from y to z
 int REDirect::rd_rotate_yz(float angle) {
     current_transform.rotate_yz_mutate(angle);
-    normal_transform.rotate_xy_mutate(angle);
+    transform_changed();
     return RD_OK;
 }
 
 // Same but in the Y-Axis from z to x
 int REDirect::rd_rotate_zx(float angle) {
     current_transform.rotate_zx_mutate(angle);
-    normal_transform.rotate_xy_mutate(angle);
+    transform_changed();
     return RD_OK;
 }
 
@@ -1386,7 +2546,6 @@ int REDirect::rd_matrix(const float* mat) {
 int REDirect::rd_xform_push() {
     //std::cout << "PUSH :\n" << current_transform << '\n';
     stack.push(current_transform); // stack makes a copy automatically so its fine
-    stack.push(normal_transform); // also this, then get this back in reverse order
     return RD_OK;
 }
 
@@ -1395,14 +2554,12 @@ int REDirect::rd_xform_pop() {
     if (stack.empty()) // Return error if empty
         return RD_INPUT_TRANSFORM_STACK_UNDERFLOW;
 
-    normal_transform = stack.top();
-    stack.pop();
-
     //std::cout << "TOP :\n" << stack.top() << '\n';
     //std::cout << "POP :\n" << current_transform << '\n';
     current_transform = stack.top();
     //std::cout << "NOW :\n" << current_transform << '\n';
     stack.pop();
+    transform_changed(); // The cached products were for the transform that was just popped off
     return RD_OK;
 }
 
@@ -1432,10 +2589,51 @@ int REDirect::rd_catmull_clark_sds(const string& vertex_type, const vector<float
 // The given size of this array (which has already been allocated when this function is called) 
 // is the number of points, not the number of values.
 // 
-// Each point in the set is passed through the point pipeline in turn, clipped, and plotted.
+// Same as passing each point through the point pipeline, but for big point clouds:
+// Object to World and World to Clip are already one matrix (object_to_clip()), the points go POINT_BATCH at a time through
+// Matrix4::multiply_batch into clip space, get clipped 4 at a time with SSE compares, go to device space (another multiply_batch)
+// and only the ones that made it are plotted.
+#define POINT_BATCH 256 // Points transformed at once
+
 int REDirect::rd_pointset(const string& vertex_type, int nvertex, const vector<float>& vertex) {
-    for (int i = 0, LENGTH = nvertex * 3; i < LENGTH; i += 3)
-        point_pipeline(vertex[i], vertex[i+1], vertex[i+2]);
+    if (!retained_frame) flush_tiles(); // Points are plotted right away, so everything before them has to be drawn first (unless retained, see plot())
+
+    const Matrix4& OBJECT_TO_CLIP = object_to_clip();
+    float clip[4][POINT_BATCH], device[4][POINT_BATCH];
+    int inside[POINT_BATCH];
+
+    for (int first = 0; first < nvertex; first += POINT_BATCH) {
+        const int COUNT = std::min(POINT_BATCH, nvertex - first);
+        OBJECT_TO_CLIP.multiply_batch(&vertex[first*3], COUNT, 3, 3, clip[0], clip[1], clip[2], clip[3]);
+        clip_to_device_transform.multiply_batch(clip[0], clip[1], clip[2], clip[3], COUNT, device[0], device[1], device[2], device[3]);
+
+        // Point clipping (same test as point_pipeline), keeps the index of every point inside
+        int inside_count = 0, i = 0;
+#ifdef __SSE2__
+        const __m128 ZERO = _mm_setzero_ps();
+        for (; i + 4 <= COUNT; i += 4) {
+            const __m128 X = _mm_loadu_ps(clip[0] + i), Y = _mm_loadu_ps(clip[1] + i);
+            const __m128 Z = _mm_loadu_ps(clip[2] + i), W = _mm_loadu_ps(clip[3] + i);
+            const __m128 OUTSIDE = _mm_or_ps(
+                _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(X, ZERO), _mm_cmplt_ps(_mm_sub_ps(W, X), ZERO)),
+                          _mm_or_ps(_mm_cmplt_ps(Y, ZERO), _mm_cmplt_ps(_mm_sub_ps(W, Y), ZERO))),
+                _mm_or_ps(_mm_cmplt_ps(Z, ZERO), _mm_cmplt_ps(_mm_sub_ps(W, Z), ZERO)));
+            for (int mask = ~_mm_movemask_ps(OUTSIDE) & 0xF; mask; mask &= mask - 1)
+                inside[inside_count++] = i + __builtin_ctz(mask);
+        }
+#endif
+        for (; i < COUNT; i++) {
+            const float X = clip[0][i], Y = clip[1][i], Z = clip[2][i], W = clip[3][i];
+            if (!(X < 0 || 0 > W-X || Y < 0 || 0 > W-Y || Z < 0 || 0 > W-Z))
+                inside[inside_count++] = i;
+        }
+
+        for (int j = 0; j < inside_count; j++) {
+            const int k = inside[j];
+            plot(device[0][k]/device[3][k], device[1][k]/device[3][k], device[2][k]/device[3][k], current_color); // Draw with z buffer
+        }
+    }
+    if (stats) stage.vertices += nvertex;
 
     return RD_OK;
 }
@@ -1458,21 +2656,30 @@ int REDirect::rd_pointset(const string& vertex_type, int nvertex, const vector<f
 // Then move to vertex 0, draw to vertex 1, draw to vertices 2, 3, back to 0 and so on.
 // TODO
 int REDirect::rd_polyset(const string& vertex_type, int nvertex, const vector<float>& vertex, int nface, const vector<int>& face) {
-    // Read
-    vector<Vector3> vertices = vector<Vector3>();
-
-    for (int i = 0, LENGTH = nvertex * 3; i < LENGTH; i += 3) {
-        vertices.push_back(Vector3(vertex[i], vertex[i+1], vertex[i+2]));
-    }
-
     // Safety check (should probably add one above as well for groups of 3)
     if (nvertex <  1) return RD_OK; // Nothing
+
+    // Drawn straight from the lists (an ObjectInstance replays the same ones, nothing is copied)
+    const float* vertices = vertex.data();
+
+    // Skip the whole set if it's off screen (sphere around its box) or its box is hidden
+    // (the box is worked out every call, the lists can change between them at the same address)
+    float min[3] = {vertices[0], vertices[1], vertices[2]}, max[3] = {vertices[0], vertices[1], vertices[2]};
+    for (int i = 3, LENGTH = nvertex * 3; i < LENGTH; i += 3)
+        for (int c = 0; c < 3; c++) {
+            min[c] = std::min(min[c], vertices[i+c]);
+            max[c] = std::max(max[c], vertices[i+c]);
+        }
+    const Vector3 MIN = Vector3(min[0], min[1], min[2]), MAX = Vector3(max[0], max[1], max[2]);
+    if (sphere_outside_frustum((MIN + MAX) / 2, (MAX - MIN).magnitude() / 2)) return RD_OK;
+    if (occlusion_culling && box_occluded(MIN, MAX)) return RD_OK;
+
     if (nvertex == 1) { // Point
-        point_pipeline(vertices[0].x, vertices[0].y, vertices[0].z);
+        point_pipeline(vertices[0], vertices[1], vertices[2]);
         return RD_OK;
     } else if (nvertex == 2) { // Line
-        line_pipeline(vertices[0]);
-        line_pipeline(vertices[1], false);
+        line_pipeline(Vector3(vertices[0], vertices[1], vertices[2]));
+        line_pipeline(Vector3(vertices[3], vertices[4], vertices[5]), false);
         return RD_OK;
     }
 
@@ -1494,39 +2701,55 @@ int REDirect::rd_polyset(const string& vertex_type, int nvertex, const vector<fl
     // a normal vector for that polygon should be calculated and stored in the global poly_normal variable. 
     // This should be done regardless of whether or not vertex normals have been calculated or provided.
 
-    // Draw (if face starts with any amount of -1's this doesnt work)
-    for (int i = 0, LENGTH = face.size(); i < LENGTH; i++) {
-        int x = face[i];
-        if (x >= 0) { // not -1: Save
-            if (face[i+1] < 0) continue; // hack for now
-
-            polygon_pipeline(vertices[x]);
-            continue;
-        }
+    draw_mesh(nvertex, vertices, nullptr, face);
 
-        // Immediately before sending the last point of a polygon to the polygon pipeline, 
-        // a normal vector for that polygon should be calculated and stored in the global poly_normal variable. 
-        // This should be done regardless of whether or not vertex normals have been calculated or provided.
-        // The polygon normal (which should be calculated and stored in the global surface normal variable [polygon_normal]) can be found by taking the cross product of two of the polygon edges. 
-        // Order is important here. If you see the vertices traversed in counter-clockwise order, the normal should be coming toward you.
-        /*
-        const Vector3 &P0 = vertices[face[i-3]];
-        const Vector3 &P1 = vertices[face[i-2]];
-        const Vector3 &P2 = vertices[face[i-1]];
-
-        polygon_normal = P1.subtract(P0); // Copy as A(p1 - p0)
-        polygon_normal.cross_mutate(P2.subtract(P1)); // C = A x B(p2-p1) to calculate normal
-        line_pipeline(Vector3()); line_pipeline(polygon_normal*2, false); // Debug for normals
-        normal_transform.multiply_mutate(polygon_normal); // Object to World
-        polygon_normal.normalize_mutate(); // Normalize
-        */
+    return RD_OK;
+}
 
-        // Last point (draws everything)
-        polygon_pipeline(vertices[face[i-1]], true);
+// Draws an indexed mesh (faces end with -1) through the polygon pipeline with the current transform.
+// Every vertex is transformed once, and faces are put together from them.
+// If normals is given, each vertex gets its own normal (like polygon_normal before each polygon_pipeline call).
+void REDirect::draw_mesh(int nvertex, const float* vertices, const float* normals, const std::vector<int>& faces) {
+    // Transform every vertex once (instead of once for every face that uses it) and save which clipping boundaries it's outside of
+    // (Object to World then World to Clip, a batch at a time with Matrix4::multiply_batch)
+    vertex_cache.resize(nvertex);
+    vertex_outcodes.resize(nvertex);
+    for (int c = 0; c < 4; c++) {
+        vertex_world[c].resize(nvertex);
+        vertex_clip[c].resize(nvertex);
     }
+    current_transform.multiply_batch(vertices, nvertex, 3, 3,
+        vertex_world[0].data(), vertex_world[1].data(), vertex_world[2].data(), vertex_world[3].data());
+    world_to_clip_transform.multiply_batch(vertex_world[0].data(), vertex_world[1].data(), vertex_world[2].data(), vertex_world[3].data(), nvertex,
+        vertex_clip[0].data(), vertex_clip[1].data(), vertex_clip[2].data(), vertex_clip[3].data());
+    for (int i = 0; i < nvertex; i++) {
+        const Point4 WORLD = Point4(vertex_world[0][i], vertex_world[1][i], vertex_world[2][i], vertex_world[3][i]);
+        const Point4 CLIP  = Point4(vertex_clip[0][i],  vertex_clip[1][i],  vertex_clip[2][i],  vertex_clip[3][i]);
+        if (normals) { // Same as the primitives did one point at a time
+            polygon_normal = normal_transform().multiply(normals[i*3], normals[i*3+1], normals[i*3+2]);
+            polygon_normal.normalize_mutate();
+        }
+        vertex_cache[i] = polygon_vertex(WORLD, CLIP);
+        vertex_outcodes[i] = polygon_outcode(vertex_cache[i]);
+    }
+    if (stats) stage.vertices += nvertex;
+
+    // Draw each face from the cache (ends at a -1 or at the end of the list)
+    for (int i = 0, LENGTH = faces.size(); i < LENGTH; i++) {
+        int any_outside = 0, all_outside = 0x3F;
+        for (; i < LENGTH && faces[i] >= 0; i++) {
+            pp_points.push_back(vertex_cache[faces[i]]);
+            any_outside |= vertex_outcodes[faces[i]];
+            all_outside &= vertex_outcodes[faces[i]];
+        }
 
-    std::cout << "\n";
-    return RD_OK;
+        if (pp_points.size() < 3 || all_outside) { // Nothing to fill, or every point is outside the same boundary
+            if (stats) { stage.polygons_submitted++; stage.polygons_culled++; }
+            pp_points.clear();
+            continue;
+        }
+        polygon_draw(any_outside == 0); // Completely inside doesn't need clipping
+    }
 }
 
 // WIP
@@ -1552,15 +2775,37 @@ int REDirect::rd_lineset(const string& vertex_type, int nvertex, const vector<fl
     return RD_OK;
 }
 
-// Run a cone through the pipeline. The cone should have a circular base of a given radius on the xy plane. 
-// The cone should have a given height in the positive z direction.
-int REDirect::rd_cone(float height, float radius, float thetamax) {
-    _vertex_normal_flag = true; // These sides are meant to be percieved as "smooth" (interp at each vertex)
-    _vertex_color_flag = false;
-    _vertex_texture_flag = false;
+// Tessellated primitives
+// Every primitive used to make the same points (with a cos and sin for each) every time it was called.
+// Now each one is tessellated once per set of parameters (and number of steps) into a unit_mesh, which draw_mesh sends through
+// the pipeline with whatever the transform is on that call. The points are made exactly like before (same floats, same order).
+enum mesh_type { MESH_CONE, MESH_CUBE, MESH_CYLINDER, MESH_DISK, MESH_SPHERE, MESH_SQSPHERE, MESH_SQTORUS };
+#define MESH_CACHE_LIMIT 256 // Start over if a scene has this many different ones (radii and so on)
+
+// Helper to put a mesh together, points with the same position and normal are only saved once
+struct mesh_builder {
+    unit_mesh& mesh;
+    bool smooth; // Saves normals
+    std::map<std::vector<float>, int> seen;
+
+    mesh_builder(unit_mesh& mesh, bool smooth) : mesh(mesh), smooth(smooth) {}
+
+    void point(const Vector3& p, const Vector3& n = Vector3()) {
+        const std::vector<float> KEY = smooth ? std::vector<float>{p.x, p.y, p.z, n.x, n.y, n.z} : std::vector<float>{p.x, p.y, p.z};
+        auto found = seen.find(KEY);
+        if (found == seen.end()) {
+            found = seen.emplace(KEY, mesh.vertices.size() / 3).first;
+            mesh.vertices.insert(mesh.vertices.end(), {p.x, p.y, p.z});
+            if (smooth) mesh.normals.insert(mesh.normals.end(), {n.x, n.y, n.z});
+        }
+        mesh.faces.push_back(found->second);
+    }
+    void end_face() { mesh.faces.push_back(-1); }
+};
 
-    // Draw loop
-    int STEPS = 20;
+// Cone: a circular base of a given radius on the xy plane, with a given height in the positive z direction.
+static void tessellate_cone(unit_mesh& mesh, float height, float radius, int STEPS) {
+    mesh_builder build(mesh, true); // These sides are meant to be percieved as "smooth" (interp at each vertex)
     const float UP = radius / height; // r/h, up direction to make the slope above xz cos/sin perpendicular to the hypotenuse
     const float RATIO = ((float)360.0 / STEPS) * (std::acos(-1)/180);
     for (int i = 0; i < STEPS; i++) {
@@ -1569,35 +2814,21 @@ int REDirect::rd_cone(float height, float radius, float thetamax) {
         const float SIN_0 = std::sin( i   *RATIO);
         const float SIN_1 = std::sin((i+1)*RATIO);
 
-        // Old Normal Calculaton for the right side (cross multiplication)
-        // polygon_normal = v1.subtract(v0); // Copy as A(p1 - p0)
-        // polygon_normal.cross_mutate(TOP.subtract(v1)); // Use B(p2-p1) to calculate normal as C (C = A x B)
-        // polygon_normal.normalize_mutate(); // Normalize
-
         // Left Side
-        polygon_normal = normal_transform.multiply(COS_0, SIN_0, UP); // Normal in world coordinates
-        polygon_normal.normalize_mutate(); // Normalize
-        polygon_pipeline(0, 0, height); // Draw from top...
-        polygon_pipeline(radius*COS_0, radius*SIN_0, 0); // ...to left bottom edge, then from here to...
+        build.point(Vector3(0, 0, height), Vector3(COS_0, SIN_0, UP)); // From top...
+        build.point(Vector3(radius*COS_0, radius*SIN_0, 0), Vector3(COS_0, SIN_0, UP)); // ...to left bottom edge, then from here to...
 
         // Right Side
-        polygon_normal = normal_transform.multiply(COS_1, SIN_1, UP);
-        polygon_normal.normalize_mutate(); // Normalize
-        polygon_pipeline(radius*COS_1, radius*SIN_1, 0); // ...right bottom edge (and save vertex for next draw), then...
-        polygon_pipeline(0, 0, height, true); // ...Draw: Finish triangle back to top tip (duplicate point for 2nd normal)
+        build.point(Vector3(radius*COS_1, radius*SIN_1, 0), Vector3(COS_1, SIN_1, UP)); // ...right bottom edge, then...
+        build.point(Vector3(0, 0, height), Vector3(COS_1, SIN_1, UP)); // ...back to top tip (duplicate point for 2nd normal)
+        build.end_face();
     }
-
-    return RD_OK;
 }
 
-// Run the faces of the cube (+/- 1 in x, y, and z) through the transformation pipeline.
-// Each face drawn in a counter clockwise order
-int REDirect::rd_cube() {
-    _vertex_normal_flag = false; // Flat shading
-    _vertex_color_flag = false;
-    _vertex_texture_flag = false;
-
-    Vector3 vertices[8] = {
+// Cube: the faces of the cube (+/- 1 in x, y, and z), each one counter clockwise facing out
+static void tessellate_cube(unit_mesh& mesh) {
+    mesh_builder build(mesh, false); // Flat shading
+    const Vector3 vertices[8] = {
         Vector3(-1,-1,-1),
         Vector3(-1,-1, 1),
         Vector3(-1, 1,-1),
@@ -1607,71 +2838,24 @@ int REDirect::rd_cube() {
         Vector3( 1, 1,-1),
         Vector3( 1, 1, 1)
     };
-
-    // Counter Clockwise facing me (hard coded)
-    // Front
-    polygon_normal = normal_transform.multiply(0,0,1); // Hard-coded normal in world space
-    polygon_normal.normalize_mutate(); // Normalize normal
-    polygon_pipeline(vertices[5]);       //  1,-1, 1
-    polygon_pipeline(vertices[7]);       //  1, 1, 1
-    polygon_pipeline(vertices[3]);       // -1, 1, 1
-    polygon_pipeline(vertices[1], true); // -1,-1, 1
-
-    // Back
-    polygon_normal = normal_transform.multiply(0,0,-1);
-    polygon_normal.normalize_mutate();
-    polygon_pipeline(vertices[6]);       //  1, 1,-1
-    polygon_pipeline(vertices[4]);       //  1,-1,-1
-    polygon_pipeline(vertices[0]);       // -1,-1,-1
-    polygon_pipeline(vertices[2], true); // -1, 1,-1
-
-    // Top
-    polygon_normal = normal_transform.multiply(0,1,0);
-    polygon_normal.normalize_mutate();
-    polygon_pipeline(vertices[7]);       //  1, 1, 1
-    polygon_pipeline(vertices[6]);       //  1, 1,-1
-    polygon_pipeline(vertices[2]);       // -1, 1,-1
-    polygon_pipeline(vertices[3], true); // -1, 1, 1
-
-    // Bottom
-    polygon_normal = normal_transform.multiply(0,-1,0);
-    polygon_normal.normalize_mutate();
-    polygon_pipeline(vertices[5]);       //  1,-1, 1
-    polygon_pipeline(vertices[1]);       // -1,-1, 1
-    polygon_pipeline(vertices[0]);       // -1,-1,-1
-    polygon_pipeline(vertices[4], true); //  1,-1,-1
-
-    // Left (my right)
-    polygon_normal = normal_transform.multiply(1,0,0);
-    polygon_normal.normalize_mutate();
-    polygon_pipeline(vertices[7]);       //  1, 1, 1
-    polygon_pipeline(vertices[5]);       //  1,-1, 1
-    polygon_pipeline(vertices[4]);       //  1,-1,-1
-    polygon_pipeline(vertices[6], true); //  1, 1,-1
-
-    // Right (my left)
-    polygon_normal = normal_transform.multiply(-1,0,0);
-    polygon_normal.normalize_mutate();
-    polygon_pipeline(vertices[2]);       // -1, 1,-1
-    polygon_pipeline(vertices[0]);       // -1,-1,-1
-    polygon_pipeline(vertices[1]);       // -1,-1, 1
-    polygon_pipeline(vertices[3], true); // -1, 1, 1
-
-    return RD_OK;
+    const int FACES[6][4] = {
+        {5, 7, 3, 1}, // Front
+        {6, 4, 0, 2}, // Back
+        {7, 6, 2, 3}, // Top
+        {5, 1, 0, 4}, // Bottom
+        {7, 5, 4, 6}, // Left (my right)
+        {2, 0, 1, 3}  // Right (my left)
+    };
+    for (const auto& face : FACES) {
+        for (int v : face)
+            build.point(vertices[v]);
+        build.end_face();
+    }
 }
 
-// Run a circular cylinder through the pipeline. 
-// The ends should be circles of a given radius parallel to the xy plane. 
-// The circles are centered at (0, 0, zmin) and (0, 0, zmax) where zmin and zmax are the z coordinates of the ends of the cylinder. 
-// Thus the cylinder extends from -radius to radius in x and y and from zmin to zmax in z.
-// Very similar to cone
-int REDirect::rd_cylinder(float radius, float zmin, float zmax, float thetamax) {
-    // Draw loop
-    _vertex_normal_flag = true; // Smooth sides
-    _vertex_color_flag = false;
-    _vertex_texture_flag = false;
-
-    const int STEPS = 20;
+// Cylinder: ends are circles of a given radius parallel to the xy plane, at (0, 0, zmin) and (0, 0, zmax) (no caps)
+static void tessellate_cylinder(unit_mesh& mesh, float radius, float zmin, float zmax, int STEPS) {
+    mesh_builder build(mesh, true); // Smooth sides
     const double RATIO = ((double)360.0 / STEPS) * (std::acos(-1)/180);
     for (int i = 0; i < STEPS; i++) {
         const float COS_0 = radius * std::cos( i   *RATIO);
@@ -1679,69 +2863,32 @@ int REDirect::rd_cylinder(float radius, float zmin, float zmax, float thetamax)
         const float SIN_0 = radius * std::sin( i   *RATIO);
         const float SIN_1 = radius * std::sin((i+1)*RATIO);
 
-        // Left Side (Left normal is stretched by radius, but it'll be normalized at the end so it's fine)
-        polygon_normal = normal_transform.multiply(COS_0, SIN_0, 0); // Object to World so it's in World Space
-        polygon_normal.normalize_mutate(); // Normalize
-        polygon_pipeline(COS_0, SIN_0, zmax); // Draw bottom edge
-        polygon_pipeline(COS_0, SIN_0, zmin); // Draw wall edge
+        // Left Side (normal is stretched by radius, but it'll be normalized when drawn so it's fine)
+        build.point(Vector3(COS_0, SIN_0, zmax), Vector3(COS_0, SIN_0, 0));
+        build.point(Vector3(COS_0, SIN_0, zmin), Vector3(COS_0, SIN_0, 0));
 
         // Right Side
-        polygon_normal = normal_transform.multiply(COS_1, SIN_1, 0);
-        polygon_normal.normalize_mutate();
-        polygon_pipeline(COS_1, SIN_1, zmin); // Draw top edge
-        polygon_pipeline(COS_1, SIN_1, zmax, true); // Move "draw pointer" to this bottom point
+        build.point(Vector3(COS_1, SIN_1, zmin), Vector3(COS_1, SIN_1, 0));
+        build.point(Vector3(COS_1, SIN_1, zmax), Vector3(COS_1, SIN_1, 0));
+        build.end_face();
     }
-
-    return RD_OK;
 }
 
-// Run a circular disc through the pipeline. The disk should have a given radius. 
-// The disk is parallel to the xy plane and centered about the z axis. 
-// A height parameters gives the position of the disk along the z axis.
-// Similar to cone
-int REDirect::rd_disk(float height, float radius, float theta) {
-    _vertex_normal_flag = false; // Flat disk
-    _vertex_color_flag = false;
-    _vertex_texture_flag = false;
-
-    // Draw loop
-    const int STEPS = 20;
+// Disk: a given radius, parallel to the xy plane and centered about the z axis at a given height
+static void tessellate_disk(unit_mesh& mesh, float height, float radius, int STEPS) {
+    mesh_builder build(mesh, false); // Flat disk
     const double RATIO = ((double)360.0 / STEPS) * (std::acos(-1)/180);
     for (int i = 0; i < STEPS; i++) {
         const float ANGLE = i*RATIO;
-        polygon_pipeline(radius * std::cos(ANGLE), 
-                         radius * std::sin(ANGLE), 
-                         height
-        );
+        build.point(Vector3(radius * std::cos(ANGLE), radius * std::sin(ANGLE), height));
     }
-
-    // Finish drawing
-    polygon_normal = normal_transform.multiply(0,0,1); // Normal pointing up (in Object to World so it's in World Space)
-    polygon_normal.normalize_mutate(); // Normalize
-    polygon_pipeline(radius, 0, height, true); // Last point
-
-    return RD_OK;
-}
-
-int REDirect::rd_hyperboloid(const float start[3], const float end[3], float thetamax) {
-    return RD_OK;
+    build.point(Vector3(radius, 0, height)); // Last point
+    build.end_face();
 }
 
-int REDirect::rd_paraboloid(float rmax, float zmin, float zmax, float thetamax) {
-    return RD_OK;
-}
-
-
-/**/
-// Run a sphere (or some representation of a sphere) through the pipeline. 
-// The sphere should be centered at the origin and have a radius given by a parameter.
-int REDirect::rd_sphere(float radius, float zmin, float zmax, float thetamax) {
-    // Setup
-    _vertex_normal_flag = true; // This while spehere is meant to be percieved as "smooth" (interp at each vertex)
-    _vertex_color_flag = false;
-    _vertex_texture_flag = false;
-
-    const int STEPS = 20; // Must be a multiple of 4
+// Sphere: centered at the origin with a given radius (STEPS must be a multiple of 4)
+static void tessellate_sphere(unit_mesh& mesh, float radius, int STEPS) {
+    mesh_builder build(mesh, true); // This whole sphere is meant to be percieved as "smooth" (interp at each vertex)
     const int Y_STEPS = STEPS/4;
     const float RATIO = ((float)360 / STEPS) * (std::acos(-1)/180); // 360/steps * pi/180 // to radians
 
@@ -1759,49 +2906,237 @@ int REDirect::rd_sphere(float radius, float zmin, float zmax, float thetamax) {
         float HORIZONTAL_COS = std::cos(horizontal_angle);
         float HORIZONTAL_SIN = std::sin(horizontal_angle);
         for (int rotation = 0; rotation < STEPS; rotation++) {
+            // Normal has the same object coords as the sphere position
             Vector3 p; // Temp value for point position in Object Space
 
             // Start (top-left)
-            p = Vector3(VERTICAL_COS_UP * HORIZONTAL_COS,
-                        VERTICAL_COS_UP * HORIZONTAL_SIN,
-                        VERTICAL_SIN_UP);
-            polygon_normal = normal_transform.multiply(p); // World normal at this point (coincidentally the same object coords as sphere position)
-            polygon_normal.normalize_mutate(); // From Object to World, now Normalize
-            polygon_pipeline(p); // Save this point
-            // line_pipeline(p); line_pipeline(p * 1.5, false); // Delete me
-
+            p = Vector3(VERTICAL_COS_UP * HORIZONTAL_COS, VERTICAL_COS_UP * HORIZONTAL_SIN, VERTICAL_SIN_UP);
+            build.point(p, p);
 
             // Down (bottom-left)
-            p = Vector3(VERTICAL_COS_DOWN * HORIZONTAL_COS,
-                        VERTICAL_COS_DOWN * HORIZONTAL_SIN,
-                        VERTICAL_SIN_DOWN);
-            polygon_normal = normal_transform.multiply(p);
-            polygon_normal.normalize_mutate();
-            polygon_pipeline(p);
-
+            p = Vector3(VERTICAL_COS_DOWN * HORIZONTAL_COS, VERTICAL_COS_DOWN * HORIZONTAL_SIN, VERTICAL_SIN_DOWN);
+            build.point(p, p);
 
             horizontal_angle += RATIO; // horizontal_angle_right = (rotation+1)*RATIO
             HORIZONTAL_COS = std::cos(horizontal_angle);
             HORIZONTAL_SIN = std::sin(horizontal_angle);
 
             // Right (bottom-right)
-            p = Vector3(VERTICAL_COS_DOWN * HORIZONTAL_COS,
-                        VERTICAL_COS_DOWN * HORIZONTAL_SIN,
-                        VERTICAL_SIN_DOWN);
-            polygon_normal = normal_transform.multiply(p);
-            polygon_normal.normalize_mutate();
-            polygon_pipeline(p);
+            p = Vector3(VERTICAL_COS_DOWN * HORIZONTAL_COS, VERTICAL_COS_DOWN * HORIZONTAL_SIN, VERTICAL_SIN_DOWN);
+            build.point(p, p);
 
             // Up and Finish (top-right)
-            p = Vector3(VERTICAL_COS_UP * HORIZONTAL_COS,
-                        VERTICAL_COS_UP * HORIZONTAL_SIN,
-                        VERTICAL_SIN_UP);
-            polygon_normal = normal_transform.multiply(p);
-            polygon_normal.normalize_mutate();
-            polygon_pipeline(p, true); // Draw
+            p = Vector3(VERTICAL_COS_UP * HORIZONTAL_COS, VERTICAL_COS_UP * HORIZONTAL_SIN, VERTICAL_SIN_UP);
+            build.point(p, p);
+            build.end_face();
+        }
+    }
+}
+
+// Because pow(negative, non-integer) == NaN
+static float ipow(float base, float exp) {
+    return std::copysign(std::pow(std::abs(base), exp), base);
+}
+
+// Superquadric sphere: radius with north (up and down) and east (around) exponents (STEPS must be a multiple of 4)
+static void tessellate_sqsphere(unit_mesh& mesh, float radius, float north, float east, int STEPS) {
+    mesh_builder build(mesh, false); // Flat, every quad gets the normal of its face
+    const float RATIO = ((float)360 / STEPS) * (std::acos(-1)/180); // 360/steps * pi/180 // to radians
+
+    for (int v = -STEPS/4; v < STEPS/4; v++) { // Y = -90 to 90
+        const float V0 = v*RATIO;
+        const float V1 = (v+1)*RATIO;
+
+        for (int u = 0; u < STEPS; u++) { // X = 0 to 360
+            const float U0 = u*RATIO;
+            const float U1 = (u+1)*RATIO;
+
+            build.point(Vector3(radius * ipow(std::cos(V0), north) * ipow(std::cos(U0), east), // Start (bottom-left)
+                                radius * ipow(std::cos(V0), north) * ipow(std::sin(U0), east),
+                                radius * ipow(std::sin(V0), north)));
+            build.point(Vector3(radius * ipow(std::cos(V0), north) * ipow(std::cos(U1), east), // Right (bottom-right)
+                                radius * ipow(std::cos(V0), north) * ipow(std::sin(U1), east),
+                                radius * ipow(std::sin(V0), north)));
+            build.point(Vector3(radius * ipow(std::cos(V1), north) * ipow(std::cos(U1), east), // Up (top-right)
+                                radius * ipow(std::cos(V1), north) * ipow(std::sin(U1), east),
+                                radius * ipow(std::sin(V1), north)));
+            build.point(Vector3(radius * ipow(std::cos(V1), north) * ipow(std::cos(U0), east), // Left and Finish (top-left)
+                                radius * ipow(std::cos(V1), north) * ipow(std::sin(U0), east),
+                                radius * ipow(std::sin(V1), north)));
+            build.end_face();
         }
     }
+}
+
+// Superquadric torus: radius1 around the z axis, radius2 around the ring, with north and east exponents (STEPS must be even)
+static void tessellate_sqtorus(unit_mesh& mesh, float radius1, float radius2, float north, float east, int STEPS) {
+    mesh_builder build(mesh, false); // Flat
+    const float RATIO = ((float)360 / STEPS) * (std::acos(-1)/180); // 360/steps * pi/180 // to radians
+
+    for (int v = -STEPS/2; v < STEPS/2; v++) { // Y = -180 to 180
+        const float V0 = v*RATIO;
+        const float V1 = (v+1)*RATIO;
+
+        for (int u = 0; u < STEPS; u++) { // X = 0 to 360
+            const float U0 = u*RATIO;
+            const float U1 = (u+1)*RATIO;
+
+            build.point(Vector3((radius1 + radius2*ipow(std::cos(V0), north)) * ipow(std::cos(U0), east), // Start (top-left)
+                                (radius1 + radius2*ipow(std::cos(V0), north)) * ipow(std::sin(U0), east),
+                                           radius2*ipow(std::sin(V0), north)));
+            build.point(Vector3((radius1 + radius2*ipow(std::cos(V0), north)) * ipow(std::cos(U1), east), // Right (top-right)
+                                (radius1 + radius2*ipow(std::cos(V0), north)) * ipow(std::sin(U1), east),
+                                           radius2*ipow(std::sin(V0), north)));
+            build.point(Vector3((radius1 + radius2*ipow(std::cos(V1), north)) * ipow(std::cos(U1), east), // Down (bottom-right)
+                                (radius1 + radius2*ipow(std::cos(V1), north)) * ipow(std::sin(U1), east),
+                                           radius2*ipow(std::sin(V1), north)));
+            build.point(Vector3((radius1 + radius2*ipow(std::cos(V1), north)) * ipow(std::cos(U0), east), // Left and Finish (bottom-left)
+                                (radius1 + radius2*ipow(std::cos(V1), north)) * ipow(std::sin(U0), east),
+                                           radius2*ipow(std::sin(V1), north)));
+            build.end_face();
+        }
+    }
+}
+
+// Level of detail
+// With OptionReal "TessellationError" set, the number of steps around a primitive comes from how big it is on the screen.
+// A circle of r pixels cut into n straight edges is off by at most r(1 - cos(pi/n)) pixels in the middle of each edge,
+// so n is the smallest that keeps that under the error. Otherwise it's always OptionReal "Divisions" (20 by default).
+#define TESSELLATION_MIN_STEPS 8
+#define TESSELLATION_MAX_STEPS 128
+
+int REDirect::tessellation_steps(const Vector3& center, float radius) {
+    int steps = divisions;
+    if (tessellation_error > 0) {
+        // Bounding sphere in World Space (scaled by the longest axis of the current transform)
+        const Vector3 WORLD_CENTER = current_transform.multiply(center);
+        const float SCALE = std::max(Vector3(current_transform.xx, current_transform.yx, current_transform.zx).magnitude(),
+                            std::max(Vector3(current_transform.xy, current_transform.yy, current_transform.zy).magnitude(),
+                                     Vector3(current_transform.xz, current_transform.yz, current_transform.zz).magnitude()));
+        const float WORLD_RADIUS = radius * SCALE;
+        const float DISTANCE = (WORLD_CENTER - camera_eye_position).magnitude();
+
+        if (DISTANCE <= WORLD_RADIUS) { // Camera is inside of it
+            steps = TESSELLATION_MAX_STEPS;
+        } else {
+            // Radius in pixels (vertical field of view spans display_ySize pixels)
+            const float PIXELS = WORLD_RADIUS / DISTANCE * (display_ySize / 2.0f) / std::tan(camera_fov / 2 * (float)std::acos(-1) / 180);
+            if (tessellation_error >= PIXELS)
+                steps = TESSELLATION_MIN_STEPS;
+            else
+                steps = std::ceil((float)std::acos(-1) / std::acos(1 - tessellation_error / PIXELS));
+        }
+        steps = std::max(TESSELLATION_MIN_STEPS, std::min(TESSELLATION_MAX_STEPS, steps));
+    }
+    return (steps + 3) / 4 * 4; // Multiple of 4 for the spheres (and fewer different meshes to cache)
+}
+
+// Finds the mesh for the key {type, parameters..., steps}, or tessellates it the first time
+const unit_mesh& REDirect::cached_mesh(const std::vector<float>& key) {
+    auto found = mesh_cache.find(key);
+    if (found != mesh_cache.end()) return found->second;
+
+    if (mesh_cache.size() >= MESH_CACHE_LIMIT) mesh_cache.clear();
+    unit_mesh& mesh = mesh_cache[key];
+    switch ((int)key[0]) {
+    case MESH_CONE:     tessellate_cone(mesh, key[1], key[2], key[3]); break;
+    case MESH_CUBE:     tessellate_cube(mesh); break;
+    case MESH_CYLINDER: tessellate_cylinder(mesh, key[1], key[2], key[3], key[4]); break;
+    case MESH_DISK:     tessellate_disk(mesh, key[1], key[2], key[3]); break;
+    case MESH_SPHERE:   tessellate_sphere(mesh, key[1], key[2]); break;
+    case MESH_SQSPHERE: tessellate_sqsphere(mesh, key[1], key[2], key[3], key[4]); break;
+    case MESH_SQTORUS:  tessellate_sqtorus(mesh, key[1], key[2], key[3], key[4], key[5]); break;
+    }
+    return mesh;
+}
+
+// Sends a cached mesh through draw_mesh
+static void draw_unit_mesh(REDirect& _this, const unit_mesh& mesh) {
+    _this.draw_mesh(mesh.vertices.size() / 3, mesh.vertices.data(), mesh.normals.empty() ? nullptr : mesh.normals.data(), mesh.faces);
+}
+
+
+// Run a cone through the pipeline. The cone should have a circular base of a given radius on the xy plane. 
+// The cone should have a given height in the positive z direction.
+int REDirect::rd_cone(float height, float radius, float thetamax) {
+    if (sphere_outside_frustum(Vector3(0,0,height/2), std::sqrt(radius*radius + height*height/4))) return RD_OK;
+    if (occlusion_culling && box_occluded(Vector3(-radius,-radius,0), Vector3(radius,radius,height))) return RD_OK;
+
+    _vertex_normal_flag = true; // These sides are meant to be percieved as "smooth" (interp at each vertex)
+    _vertex_color_flag = false;
+    _vertex_texture_flag = false;
+
+    draw_unit_mesh(*this, cached_mesh({MESH_CONE, height, radius, (float)tessellation_steps(Vector3(0,0,height/2), std::max(radius, height/2))}));
+    return RD_OK;
+}
+
+// Run the faces of the cube (+/- 1 in x, y, and z) through the transformation pipeline.
+// Each face drawn in a counter clockwise order
+int REDirect::rd_cube() {
+    if (sphere_outside_frustum(Vector3(0,0,0), std::sqrt(3.0f))) return RD_OK;
+    if (occlusion_culling && box_occluded(Vector3(-1,-1,-1), Vector3(1,1,1))) return RD_OK;
+
+    _vertex_normal_flag = false; // Flat shading
+    _vertex_color_flag = false;
+    _vertex_texture_flag = false;
+
+    draw_unit_mesh(*this, cached_mesh({MESH_CUBE}));
+    return RD_OK;
+}
+
+// Run a circular cylinder through the pipeline. 
+// The ends should be circles of a given radius parallel to the xy plane. 
+// The circles are centered at (0, 0, zmin) and (0, 0, zmax) where zmin and zmax are the z coordinates of the ends of the cylinder. 
+// Thus the cylinder extends from -radius to radius in x and y and from zmin to zmax in z.
+int REDirect::rd_cylinder(float radius, float zmin, float zmax, float thetamax) {
+    if (sphere_outside_frustum(Vector3(0,0,(zmin+zmax)/2), std::sqrt(radius*radius + (zmax-zmin)*(zmax-zmin)/4))) return RD_OK;
+    if (occlusion_culling && box_occluded(Vector3(-radius,-radius,zmin), Vector3(radius,radius,zmax))) return RD_OK;
+
+    _vertex_normal_flag = true; // Smooth sides
+    _vertex_color_flag = false;
+    _vertex_texture_flag = false;
+
+    draw_unit_mesh(*this, cached_mesh({MESH_CYLINDER, radius, zmin, zmax, (float)tessellation_steps(Vector3(0,0,(zmin+zmax)/2), radius)}));
+    return RD_OK;
+}
+
+// Run a circular disc through the pipeline. The disk should have a given radius. 
+// The disk is parallel to the xy plane and centered about the z axis. 
+// A height parameters gives the position of the disk along the z axis.
+int REDirect::rd_disk(float height, float radius, float theta) {
+    if (sphere_outside_frustum(Vector3(0,0,height), radius)) return RD_OK;
+    if (occlusion_culling && box_occluded(Vector3(-radius,-radius,height), Vector3(radius,radius,height))) return RD_OK;
+
+    _vertex_normal_flag = false; // Flat disk
+    _vertex_color_flag = false;
+    _vertex_texture_flag = false;
+
+    draw_unit_mesh(*this, cached_mesh({MESH_DISK, height, radius, (float)tessellation_steps(Vector3(0,0,height), radius)}));
+    return RD_OK;
+}
+
+int REDirect::rd_hyperboloid(const float start[3], const float end[3], float thetamax) {
+    return RD_OK;
+}
 
+int REDirect::rd_paraboloid(float rmax, float zmin, float zmax, float thetamax) {
+    return RD_OK;
+}
+
+
+/**/
+// Run a sphere (or some representation of a sphere) through the pipeline. 
+// The sphere should be centered at the origin and have a radius given by a parameter.
+int REDirect::rd_sphere(float radius, float zmin, float zmax, float thetamax) {
+    if (sphere_outside_frustum(Vector3(0,0,0), radius)) return RD_OK;
+    if (occlusion_culling && box_occluded(Vector3(-radius,-radius,-radius), Vector3(radius,radius,radius))) return RD_OK;
+
+    // Setup
+    _vertex_normal_flag = true; // This while spehere is meant to be percieved as "smooth" (interp at each vertex)
+    _vertex_color_flag = false;
+    _vertex_texture_flag = false;
+
+    draw_unit_mesh(*this, cached_mesh({MESH_SPHERE, radius, (float)tessellation_steps(Vector3(0,0,0), radius)})); // Steps must be a multiple of 4
     return RD_OK;
 }
 //*/
@@ -1856,11 +3191,30 @@ int REDirect::rd_sphere(float radius, float zmin, float zmax, float thetamax) {
 
 
 
+// Superquadric sphere (same as Modeling's, zmin, zmax and thetamax are ignored)
 int REDirect::rd_sqsphere(float radius, float north, float east, float zmin, float zmax, float thetamax) {
+    if (sphere_outside_frustum(Vector3(0,0,0), radius*std::sqrt(3.0f))) return RD_OK; // Can be as square as a cube
+    if (occlusion_culling && box_occluded(Vector3(-radius,-radius,-radius), Vector3(radius,radius,radius))) return RD_OK;
+
+    _vertex_normal_flag = false; // Flat
+    _vertex_color_flag = false;
+    _vertex_texture_flag = false;
+
+    draw_unit_mesh(*this, cached_mesh({MESH_SQSPHERE, radius, north, east, (float)tessellation_steps(Vector3(0,0,0), radius)}));
     return RD_OK;
 }
 
+// Superquadric torus (same as Modeling's, phimin, phimax and thetamax are ignored)
 int REDirect::rd_sqtorus(float radius1, float radius2, float north, float east, float phimin, float phimax, float thetamax) {
+    const Vector3 CORNER = Vector3(radius1 + radius2, radius1 + radius2, radius2);
+    if (sphere_outside_frustum(Vector3(0,0,0), CORNER.magnitude())) return RD_OK;
+    if (occlusion_culling && box_occluded(-CORNER, CORNER)) return RD_OK;
+
+    _vertex_normal_flag = false; // Flat
+    _vertex_color_flag = false;
+    _vertex_texture_flag = false;
+
+    draw_unit_mesh(*this, cached_mesh({MESH_SQTORUS, radius1, radius2, north, east, (float)tessellation_steps(Vector3(0,0,0), radius1 + radius2)}));
     return RD_OK;
 }
 
@@ -1898,16 +3252,19 @@ int REDirect::rd_cone_light(const float pos[3], const float at[3], float theta_m
 }
 
 int REDirect::rd_point_light(const float pos[3], const float color[], float intensity) {
+    flush_tiles(); // Binned polygons are shaded with the lights they were sent with
     light_data l; // Intensity parameters for each light should simply be multiplied by the color before being stored in the light color.
     l.rgb[0] = intensity * color[0]; 
     l.rgb[1] = intensity * color[1]; 
     l.rgb[2] = intensity * color[2];
     l.xyz = Vector3(pos);
     point_lights.push_back(l); // Add data
+    light_arrays.add_point(pos, l.rgb);
     return RD_OK;
 }
 
 int REDirect::rd_far_light(const float dir[3], const float color[], float intensity) {
+    flush_tiles(); // Binned polygons are shaded with the lights they were sent with
     light_data l; // Intensity parameters for each light should simply be multiplied by the color before being stored in the light color.
     l.rgb[0] = intensity * color[0]; 
     l.rgb[1] = intensity * color[1]; 
@@ -1915,10 +3272,13 @@ int REDirect::rd_far_light(const float dir[3], const float color[], float intens
     l.xyz = Vector3(dir);
     l.xyz.normalize_mutate(); // Normalize just in case;
     far_lights.push_back(l); // Add data
+    float xyz[3]; l.xyz.into_array(xyz);
+    light_arrays.add_far(xyz, l.rgb);
     return RD_OK;
 }
 
 int REDirect::rd_ambient_light(const float color[], float intensity) {
+    flush_tiles(); // Binned polygons are shaded with the lights they were sent with
     ambient_light[0] = intensity * color[0];
     ambient_light[1] = intensity * color[1];
     ambient_light[2] = intensity * color[2];
@@ -1997,6 +3357,24 @@ int REDirect::rd_option_bool(const string& name, bool flag) {
     // use normals if both _vertex_normal_flag and vertex_interpolation_flag is true
     if (name == "Interpolate")
         vertex_interpolation_flag = flag;
+    else if (name == "Tiled") { // Takes effect at the next WorldBegin
+        flush_tiles();
+        tiled_mode = flag;
+    } else if (name == "DepthPrepass") { // Same
+        flush_tiles();
+        depth_prepass = flag;
+    } else if (name == "Retained") { // Same
+        flush_tiles();
+        retained_mode = flag;
+    } else if (name == "OcclusionCulling") { // Same
+        flush_tiles();
+        occlusion_culling = flag;
+    } else if (name == "DoubleSide") // Off culls back-facing polygons
+        double_side = flag;
+    else if (name == "SpanShading") // matte, metal and plastic are shaded in batches (see span_shading.h)
+        span_shading = flag;
+    else if (name == "Stats")
+        stats = flag;
     else if (name == "NORMAL?")
         _vertex_normal_flag = flag;
 
@@ -2008,10 +3386,28 @@ int REDirect::rd_option_list(const string& name, int n, const vector<string>& va
 }
 
 int REDirect::rd_option_real(const string& name, float value) {
+    if (name == "Threads") // For tiled mode
+        tile_threads = value;
+    else if (name == "Divisions") // Steps around the tessellated primitives
+        divisions = value;
+    else if (name == "TessellationError") // Pixels, or 0 to always use the divisions
+        tessellation_error = value;
+    else if (name == "GuardBand") // Screens past each side that x and y get clipped at, 0 clips at the screen
+        guard_band = std::max(0.0f, value);
+
     return RD_OK;
 }
 
 int REDirect::rd_option_string(const string& name, const string& value) {
+    if (name == "Rasterizer") { // "scanline" (default) or "halfspace" for triangles
+        flush_tiles();
+        halfspace_rasterizer = (value == "halfspace");
+    }
+    else if (name == "DepthFormat") { // "float" (default), "reversed", "unorm24", "unorm16" or "minmax", see depth_buffer.h
+        if (!DepthBuffer::parse(value, z_buffer_format))
+            std::cerr << "Unknown DepthFormat \"" << value << "\"" << std::endl;
+    }
+
     return RD_OK;
 }
 
@@ -2020,4 +3416,5 @@ int REDirect::rd_custom(const string& label) {
 }
 
 REDirect::~REDirect() {
+    stop_workers();
 }
\ No newline at end of file
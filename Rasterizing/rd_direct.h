@@ -4,21 +4,145 @@
 #include "rd_enginebase.h"
 
 #include "Matrix4.h" // Brings Vector3 and Point4 with it as well
+#include "span_shading.h" // For OptionBool "SpanShading"
+#include "depth_buffer.h" // For OptionString "DepthFormat"
 
 #include <stack> // Only for the tranformation stack
 #include <vector> // For the z_buffer
 #include <queue> // For the line_pipeline
 #include <string>
+#include <map> // For the unit mesh cache
+#include <thread> // For the tiled mode workers
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 
 
 // Edge (only used in scan_conversion)
 // An edge structure is needed to hold the all the data associated with an edge that is scan converted. It should contain:
 struct Edge {
+    int yFirst;     // First scan line of edge (replaces the edge table, edges are sorted by this instead)
     int yLast;      // Final scan line of edge
-    attr_point p;   // The values of the edge on this scan line
-    attr_point inc; // The incremental changes for the values from scanline to scanline
+    attr_point p;     // The values of the edge on this scan line
+    attr_point first; // The values of the edge on yFirst (p is worked out from these, so it's the same whichever scanline it started being stepped from)
+    attr_point inc;   // The incremental changes for the values from scanline to scanline
+};
+
+// Edge pool (only used in scan_conversion)
+// Every edge of the polygon being scan converted lives back to back in here instead of being allocated one by one,
+// and the active edge table (AET) is a small array of them sorted by x.
+// Both are cleared for each polygon but keep their memory, so scan conversion stops allocating once they've grown big enough.
+struct EdgePool {
+    std::vector<Edge> edges;   // Sorted by yFirst once the edge list is built
+    std::vector<Edge*> active; // The AET
+    std::vector<Edge*> resort; // Scratch space for re-sorting the AET
+};
+
+// Span kernels
+// The rasterizers are templates on which attributes they step (attr_format) and which shader they call (shader_kind).
+// rasterize() picks the one that fits the polygon from the vertex flags and the surface shader.
+enum attr_format {
+    ATTRS_DEPTH,  // Only x and depth (depth prepass)
+    ATTRS_FLAT,   // Plus the constant and the world position (flat shaded)
+    ATTRS_SMOOTH, // Plus the vertex normal (interpolated normals)
+    ATTRS_COUNT
+};
+enum shader_kind { SHADER_MATTE, SHADER_METAL, SHADER_PLASTIC, SHADER_OTHER, SHADER_COUNT }; // OTHER goes through surface_shader
+
+// Everything the shaders read that can change from polygon to polygon
+// (only used in tiled mode, so a binned polygon can be shaded later on by another thread)
+struct shading_state {
+    void (*shader)(float color[3]);
+    float surface_color[3], specular_color[3], specular_exponent;
+    float ambient_coefficient, diffuse_coefficient, specular_coefficient;
+    bool vertex_color_flag, vertex_normal_flag, vertex_texture_flag, vertex_interpolation_flag;
+    Vector3 polygon_normal;
+};
+
+// A clipped polygon in device space waiting in the tile bins (only used in tiled mode)
+struct binned_polygon {
+    int first, count; // Range of its vertices in tiled_points
+    shading_state state;
+};
+
+// Counters and timers for each stage of the pipeline (OptionBool "Stats"), only touched while it's on
+// In tiled mode every tile counts its own until flush_tiles() adds them to the frame's
+struct stage_stats {
+    long vertices;            // Points transformed from Object Space to Clip Space
+    long polygons_submitted;  // Polygons handed to polygon_draw() (or rejected by draw_mesh() before it)
+    long polygons_culled;     // Dropped before being rasterized (back-facing, outside, off the screen or occluded)
+    long polygons_clipped;    // Sent through polygon_clipping() (the rest were trivially accepted)
+    long polygons_rasterized; // Scan converted (once per tile it touches, and again for the shading pass after a depth prepass)
+    long edges;               // Edges made by buildEdgeList()
+    long spans;               // Non-empty spans filled by fill_between_the_edges()
+    double pipeline_time, clipping_time, raster_time, end_frame_time; // Seconds (raster_time is summed over the tile workers)
+
+    void clear() { *this = stage_stats(); }
+    void add(const stage_stats& s) {
+        vertices += s.vertices;
+        polygons_submitted += s.polygons_submitted; polygons_culled += s.polygons_culled;
+        polygons_clipped += s.polygons_clipped; polygons_rasterized += s.polygons_rasterized;
+        edges += s.edges; spans += s.spans;
+        pipeline_time += s.pipeline_time; clipping_time += s.clipping_time;
+        raster_time += s.raster_time; end_frame_time += s.end_frame_time;
+    }
+};
+
+// Tile (only used in tiled mode)
+// A TILE_SIZE x TILE_SIZE rectangle of the screen. Each tile is rasterized by one worker at a time,
+// which owns its slice of the z_buffer and its own color buffer until the tile is written back to the display.
+#define TILE_SIZE 64
+#define HIZ_SIZE 8 // Pixels across a level 0 hierarchical Z block (and level 0 blocks across a level 1 block)
+enum raster_pass {
+    PASS_NORMAL,      // Depth test, shade and plot
+    PASS_DEPTH_ONLY,  // Depth prepass, only the z_buffer is written
+    PASS_SHADE_EQUAL  // After the prepass, only shade fragments that match the z_buffer
+};
+struct Tile {
+    int x0, y0, x1, y1;        // Pixel bounds, [x0,x1) by [y0,y1)
+    std::vector<float> color;  // rgb of every pixel in the tile (row major)
+    std::vector<bool> written; // Whether the pixel was plotted and needs to be written back
+    std::vector<int> polygons; // Indices into binned_polygons that touch this tile, in submission order (-1-i for deferred_fragments[i])
+    raster_pass pass;          // What the worker is doing with the polygons right now
+    long fragments_rejected, fragments_shaded, fragments_written; // Stats, added to the totals when the tile is written back
+    long depth_reads, depth_writes;
+    long polygons_occluded;    // Binned polygons skipped by the hierarchical Z test in this tile
+    stage_stats stage;
+    uint64_t hash;             // Of everything binned into it (retained mode)
+    bool reused;               // Copied from last frame instead of rasterized (retained mode)
+};
 
-    Edge* next;     // A pointer to link the edges together in edge tables.
+// The tiled mode workers, started the first time flush_tiles() needs them and kept until the engine is destroyed
+// (the thread calling flush_tiles() works too, so there's one less of these than OptionReal "Threads")
+struct tile_worker_pool {
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable wake, done; // A new job for the workers / the last one finished it
+    const std::function<void(EdgePool&)>* job = nullptr; // Run once by every worker (with its own edge pool)
+    long generation = 0; // Goes up once per job, so a worker can tell it hasn't run this one yet
+    int busy = 0;        // Workers still running the job
+    bool quit = false;
+};
+
+// A pixel of a point or line waiting in the tiles (only used in retained mode)
+struct deferred_fragment {
+    int x, y;
+    float z, color[3];
+};
+
+// Fragments that passed the depth test, waiting to be shaded together (only used with OptionBool "SpanShading")
+struct span_batch {
+    int x[SPAN_SIZE], y[SPAN_SIZE];
+    float z[SPAN_SIZE];
+    span_fragments fragments; // Their normals and positions (and colors once shaded), fragments.count of them
+};
+
+// A primitive (sphere, cone, ...) tessellated once and reused by every call with the same parameters
+// Indexed like rd_polyset, every face ends with a -1
+struct unit_mesh {
+    std::vector<float> vertices; // xyz of each vertex in Object Space
+    std::vector<float> normals;  // xyz normal of each vertex in Object Space before normal_transform (empty for flat shaded meshes)
+    std::vector<int> faces;
 };
 
 struct light_data { // Only used as a way to store light data (currently only far light and point lights
@@ -28,30 +152,38 @@ struct light_data { // Only used as a way to store light data (currently only fa
 
 
 // These are global because having them as members is a pain rn
-attr_point surface_point_values; // An attributed point, surface_point_values which is set with interpolated values during polygon scan conversion. These values are used during lighting calculations.
+// (thread_local so the tiled mode workers can each shade their own polygon)
+thread_local span_batch pending_span; // The fragments of the polygon being drawn that haven't been shaded yet (OptionBool "SpanShading")
+thread_local attr_point surface_point_values; // An attributed point, surface_point_values which is set with interpolated values during polygon scan conversion. These values are used during lighting calculations.
 
 // An ambient coefficient, a diffuse coefficient, and a specular coefficient. Default values should be 1, 0, and 0 respectively.
-float ambient_coefficient, diffuse_coefficient, specular_coefficient; // Global lighting
+thread_local float ambient_coefficient, diffuse_coefficient, specular_coefficient; // Global lighting
 
 // Four flags. Three of these indicate the existence of information associated with each attributed point vertex of a polygon
-bool _vertex_color_flag, _vertex_normal_flag, _vertex_texture_flag, vertex_interpolation_flag; // The fourth flag is an interpolation flag that determines whether or not interpolated values are used in lighting calculations.
+thread_local bool _vertex_color_flag, _vertex_normal_flag, _vertex_texture_flag, vertex_interpolation_flag; // The fourth flag is an interpolation flag that determines whether or not interpolated values are used in lighting calculations.
 
-Vector3 viewing_vector; // This is the direction from a surface point, to the eye and is calculated for each surface point processed, as needed.
-Vector3 polygon_normal; // This is the surface normal for a polygon. It may or may not be used depending on whether a constant polygon normal value is used for lighting or an interpolated normal value is used.
+thread_local Vector3 viewing_vector; // This is the direction from a surface point, to the eye and is calculated for each surface point processed, as needed.
+thread_local Vector3 polygon_normal; // This is the surface normal for a polygon. It may or may not be used depending on whether a constant polygon normal value is used for lighting or an interpolated normal value is used.
 // Note: Couldn't polygon_normal just be in polygon_pipeline(..., true)?
 
+// Guard band (OptionReal "GuardBand"): how many screen widths (or heights) past each side of the screen polygons get clipped in x and y.
+// Anything between the screen and that is left for the rasterizers to skip, they only draw inside the screen anyway.
+// 0 clips right at the screen edges like normal. Near and far are always clipped where they are.
+float guard_band;
+
 // The lights and any associated information (number of each type of light).
 float ambient_light[3];
 std::vector<light_data> far_lights;
 std::vector<light_data> point_lights;
-float surface_color[3];  // A surface color. This will take over the role of the current drawing color. It should have a default value of white.
-float specular_color[3]; // A specular color. This is the color that will be used in specular lighting calculations. It has a default value of white.
-float specular_exponent; // A specular exponent. The default value is 10.0.
+span_lights light_arrays; // The same lights split into arrays for shade_span()
+thread_local float surface_color[3];  // A surface color. This will take over the role of the current drawing color. It should have a default value of white.
+thread_local float specular_color[3]; // A specular color. This is the color that will be used in specular lighting calculations. It has a default value of white.
+thread_local float specular_exponent; // A specular exponent. The default value is 10.0.
 
 // A pointer to a function that takes a reference to a color and returns void. This is the surface_shader. 
 // You should have three functions, matte, metal, and plastic each of which takes a reference to a color and returns void. 
 // The function pointer surface_shader should have a default value of the matte function.
-void (*surface_shader)(float color[3]); // Default is matte
+thread_local void (*surface_shader)(float color[3]); // Default is matte
 void matte(float color[3]);
 void metal(float color[3]);
 void plastic(float color[3]);
@@ -72,11 +204,14 @@ private:
     int frame_number;
 
     // Global Transformation Variables
-    Matrix4 GARBAGE; // if this is removed then current_transform is hit with garbage and nothing works and I dont know why (this appears to 'tank' the garbage)
     Matrix4 current_transform;        // Transformation matrix for the object to world transformation
     Matrix4 world_to_clip_transform;  // Transformation matrix for the world to clipping coordinates transformation
     Matrix4 clip_to_device_transform; // Transformation matrix for the clipping to device coordinates transformation.
-    Matrix4 normal_transform;         // All polygon normals must be transformed by a normal transformation matrix. This is similar to the current transformation matrix.
+
+    // Products of the transforms above, only recomputed when they're asked for after one of them changed (see transform_changed())
+    Matrix4 object_to_clip_cache; // world_to_clip_transform * current_transform
+    Matrix4 normal_cache;         // Inverse transpose of current_transform, for normals
+    bool object_to_clip_dirty, normal_dirty;
 
     std::stack<Matrix4> stack; // The stack of transformation matrices that hold the values of the current modeling transformation as it changes.
 
@@ -85,11 +220,95 @@ private:
     float camera_near; // Camera near clipping depth (Default is 1)
     float camera_far;  // Camera far clipping depth (Default is 1 billion)
 
-    std::vector<float> z_buffer; // Depth buffer respesenting a 2d screen X*Y, accessed with (y*X + x)
+    DepthBuffer z_buffer; // Depth buffer respesenting a 2d screen X*Y, accessed with (y*X + x)
+    depth_format z_buffer_format; // OptionString "DepthFormat", what z_buffer is made as at the next WorldBegin
+
+    // Tiled mode (OptionBool "Tiled")
+    // Instead of scan converting right away, clipped polygons are binned into tiles and
+    // rasterized in parallel by a pool of workers when flush_tiles() is called
+    bool tiled_mode;      // Default is false
+    int tile_threads;     // Number of workers (OptionReal "Threads", 0 for one per core)
+    int tiles_x, tiles_y; // Number of tiles across and down the screen
+    std::vector<Tile> tiles;
+    std::vector<binned_polygon> binned_polygons;
+    std::vector<attr_point> tiled_points; // Vertices of every binned polygon back to back
+    tile_worker_pool workers;
+    void run_workers(int count, const std::function<void(EdgePool&)>& job); // Runs job on count threads (this one included) and waits for all of them
+    void stop_workers();
+
+    // Retained mode (OptionBool "Retained")
+    // Everything is held in the tiles until WorldEnd like tiled mode (points and lines too, see plot()), and a tile
+    // whose contents hash the same as last frame's gets last frame's colors and depths back instead of being drawn again.
+    // Only the tiles where something moved, appeared or went away (the damaged ones) are rasterized.
+    bool retained_mode;  // Takes effect at the next WorldBegin
+    bool retained_frame; // The frame being drawn is retained
+    bool retained_valid;   // Last frame is all in the arrays below
+    bool retained_flushed; // The tiles were flushed in the middle of this frame (by a fill, a light after some polygons, ...), so none of it is saved
+    std::vector<uint64_t> retained_hash;      // Hash of each tile last frame
+    std::vector<float> retained_color;        // Last frame's rgb, depth and written flag of every pixel
+    std::vector<float> retained_depth;
+    std::vector<char> retained_written;
+    std::vector<deferred_fragment> deferred_fragments; // Point and line pixels in the tiles this frame
+    float background[3];   // Last rd_background() (it's in the frame's hash)
+    long tiles_reused;     // Stats
+    uint64_t frame_hash(); // Everything outside of the tiles that changes how they look (lights, background, ...)
+    uint64_t tile_hash(const Tile& tile, uint64_t frame);
+    void reuse_tile(Tile& tile);  // Puts last frame's depths back in the tile's slice of the z_buffer
+    void retain_tile(Tile& tile); // Saves the tile's colors and depths for next frame
+
+    // Depth prepass (OptionBool "DepthPrepass")
+    // Polygons are held in the tile bins like tiled mode, then each tile is rasterized twice:
+    // depth only first, then only the fragments that are still closest are shaded
+    bool depth_prepass;
+
+    // Stats (OptionBool "Stats"), printed at WorldEnd (stats and stage are public further down)
+    long fragments_rejected; // Fragments hidden by the depth test before being shaded
+    long fragments_shaded;  // Fragments that passed the depth test and went through the surface shader
+    long fragments_written; // Fragments that were actually plotted
+    long depth_reads, depth_writes; // Depth buffer traffic (times bytes_per_pixel() for the bytes)
+    std::vector<uint16_t> overdraw; // Times each pixel was plotted this frame (only sized while stats is on)
+
+    // Culling before clipping
+    bool double_side; // OptionBool "DoubleSide", back-facing polygons are only drawn if on
+    long polygons_backfacing, primitives_outside; // Stats
+    bool back_facing(const std::vector<attr_point>& points);              // If a Clip Space polygon goes clockwise on the screen
+    bool sphere_outside_frustum(const Vector3& center, float radius); // If an Object Space sphere is completely outside the view
+
+    // Hierarchical Z (OptionBool "OcclusionCulling")
+    // A two level pyramid of the farthest depth in blocks of the z_buffer, used to skip polygons
+    // (and whole primitives) that are behind everything already drawn where they would go.
+    // When polygons are binned into tiles, the z_buffer is only written when they're flushed, so polygons are tested
+    // by the worker drawing each tile instead (a level 1 block is a tile, so every worker only touches its own blocks).
+    // Whole primitives are still tested as they come in, against whatever was flushed before them.
+    bool occlusion_culling;
+    int hiz_w[2], hiz_h[2];            // Number of blocks across and down in each level
+    std::vector<float> hiz[2];         // Farthest depth in each block
+    std::vector<char> hiz_dirty[2];    // If the z_buffer under the block changed since its depth was found
+    long polygons_occluded, primitives_occluded; // Stats
+
+    void depth_written(int x, int y);         // Marks the blocks under a pixel dirty
+    float hiz_max(int level, int bx, int by); // Farthest depth of a block (found again if dirty)
+    bool occluded(float xmin, float ymin, float xmax, float ymax, float zmin, const Tile* tile = nullptr); // If a screen rectangle at this closest depth is hidden (in the tile if given)
+    bool polygon_occluded(const attr_point* points, int count, const Tile* tile = nullptr); // Same for a device space polygon
+    bool box_occluded(const Vector3& min, const Vector3& max);    // Same for an object space box through the current transforms
+
+    bool halfspace_rasterizer; // OptionString "Rasterizer" "halfspace", triangles use halfspace_triangle() instead of scan_conversion()
+    template <int FORMAT, int SHADER> void halfspace_triangle(const attr_point* points, Tile* tile); // Draws a device space triangle (into the tile if given)
+    template <int FORMAT, int SHADER> void rasterize_kernel(const attr_point* points, int count, EdgePool& pool, Tile* tile); // One of the span kernels
+    void rasterize(const attr_point* points, int count, EdgePool& pool, Tile* tile); // Draws a device space polygon with the selected rasterizer and span kernel
+
+    bool span_shading; // OptionBool "SpanShading", fragments are shaded in batches by shade_span() instead of one at a time
+    void flush_span(shader_kind shader, Tile* tile); // Shades and plots the fragments in pending_span
+
+    void bin_polygon(const std::vector<attr_point>& points); // Saves a device space polygon and the current shading state into the tiles it touches
+    void rasterize_tile(Tile& tile, EdgePool& pool); // Scan converts every polygon binned into this tile (called by the workers)
 
 public:
 
-    Edge* edge_table; // Only used in scan_conversion()
+    EdgePool edge_pool; // Only used in scan_conversion()
+
+    bool stats;        // OptionBool "Stats"
+    stage_stats stage; // Stage counters of this frame (public for scan_conversion())
 
     float current_color[3];  // Current RD color
     
@@ -99,6 +318,16 @@ public:
     // x and y are screen coordinates, z is the screen 'depth' from 0.0 to 1.0, with 0 being the closest
     // True if plotted, else false and nothing happened
     bool plot(int x, int y, float z, const float color[3]);
+    bool plot(Tile& tile, int x, int y, float z, const float color[3]); // Same, but into the tile's color buffer instead of the display
+
+    // Depth tests, shades and plots a fragment of a polygon with its interpolated (not yet divided) attributes
+    // (only the ones in FORMAT are read, and it's shaded with SHADER)
+    template <int FORMAT, int SHADER> void fragment(int x, int y, const attr_point& value, Tile* tile);
+
+    // Rasterizes everything waiting in the tile bins and writes the tiles back to the display.
+    // Must be called before anything reads or writes the display directly (does nothing if the bins are empty)
+    // frame_end is only true from rd_world_end(), the only time retained mode can reuse tiles
+    void flush_tiles(bool frame_end = false);
 
     // The point pipeline should take a homogeneous point 
     // and transform it by the current transform and the world to clipping transform. 
@@ -107,6 +336,11 @@ public:
     // If it passes this test, the point is converted to device coordinates and plotted.
     void point_pipeline(float x, float y, float z);
 
+    // Cached transforms (anything that changes current_transform or world_to_clip_transform has to call transform_changed())
+    void transform_changed();           // Marks the cached products out of date
+    const Matrix4& object_to_clip();    // world_to_clip_transform * current_transform, for anything that doesn't need World Space
+    const Matrix4& normal_transform();  // All polygon normals must be transformed by this (the inverse transpose of current_transform)
+
     // This draws a line passing the points
     // Note: works with 3 or more consecutive lines that end at start
     //       else if drawing with no end (or like 1 or 2 lines), 
@@ -126,6 +360,24 @@ public:
     void polygon_pipeline(float x, float y, float z, bool finish_and_draw);
     void polygon_pipeline(Vector3 v); // Save point (identical to calling it with false)
     void polygon_pipeline(Vector3 v, bool finish_and_draw); // Save point or End and draw.
+    attr_point polygon_vertex(const Vector3& v); // Object Space point to an attributed point in Clip Space
+    attr_point polygon_vertex(const Point4& world, const Point4& clip); // Same, already transformed to World and Clip Space
+    void polygon_draw(bool inside);              // Clips (unless inside is true) and draws pp_points
+
+    // draw_mesh transforms every vertex once into here, with the clipping boundaries it's outside of (bit per boundary)
+    std::vector<attr_point> vertex_cache;
+    std::vector<int> vertex_outcodes;
+    std::vector<float> vertex_world[4], vertex_clip[4]; // xyzw arrays from Matrix4::multiply_batch
+    void draw_mesh(int nvertex, const float* vertices, const float* normals, const std::vector<int>& faces); // Draws an indexed mesh (normals can be nullptr)
+
+    // Tessellated primitives, by type and parameters (the key also holds the number of steps)
+    std::map<std::vector<float>, unit_mesh> mesh_cache;
+    const unit_mesh& cached_mesh(const std::vector<float>& key);
+
+    // Level of detail for the tessellated primitives
+    float divisions;          // OptionReal "Divisions", steps around a primitive when not adaptive (Default is 20)
+    float tessellation_error; // OptionReal "TessellationError", most pixels a curve can be off by (0 is off, always uses divisions)
+    int tessellation_steps(const Vector3& center, float radius); // Steps for an Object Space bounding sphere on the screen right now
 
 
     /**********************   General functions  *******************************/
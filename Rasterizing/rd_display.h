@@ -37,6 +37,24 @@ extern int (* rd_write_pixel)(int x, int y, const float rgb []);
    green in 1; and blue in 2. x and y are in the range from 0 up to 
    but not including display_xSize and display_ySize respectively.*/
 
+extern int (* rd_write_span)(int y, int x0, int x1, const float rgb []);
+/* Writes the x1 - x0 pixels from (x0, y) up to but not including (x1, y).
+   rgb holds 3 floats per pixel, one pixel after another, in the same
+   0.0-1.0 range as rd_write_pixel(). Drivers that don't have their own
+   get rd_write_span_default(), which calls rd_write_pixel() for each one. */
+
+int rd_write_span_default(int y, int x0, int x1, const float rgb []);
+
+extern unsigned char * display_pixels;
+/* The frame buffer of the display, if it has one the engine may write
+   directly: display_ySize rows of display_xSize pixels, 3 bytes (r, g, b)
+   per pixel, all back to back.  NULL if the driver needs every pixel to
+   go through rd_write_pixel() (like the Screen driver).  Set by
+   rd_disp_init_display(). */
+
+/* Color component (0.0-1.0) to a byte of display_pixels, rounded */
+inline unsigned char rd_color_byte(float c){return (int)(c * 255.0f + .5);}
+
 extern int (* rd_read_pixel)(int x, int y, float rgb []);
 /* Reads the color at location (x, y) into r, g, and b.   Color component 
    values are in the range 0.0-1.0. Red, green, and blue are read into
@@ -59,4 +77,4 @@ int rd_set_display(const string & name, const string & type,
 int rd_set_format(int xresolution, int yresolution);
 
 
-#endif /* RD_DISPLAY_H */
\ No newline at end of file
+#endif /* RD_DISPLAY_H */
@@ -0,0 +1,46 @@
+// Same as rd/rd_engine.cc, but REDirect is made by new_REDirect() in rd_direct.cc.
+// The copy inside libcs631.a was compiled with the empty REDirect in rd/rd_direct.h, so its "new REDirect" only
+// allocated room for the vtable and every member of ours was written past the end of it.
+// rd_engine.o has to come before libcs631.a when linking so this one is used.
+
+#include "rd_engine.h"
+#include "rd_error.h"
+
+// Add new rendering engines to this list
+// (rd_direct.h has globals in it, so it can only be included by rd_direct.cc)
+RenderEngine* new_REDirect();
+
+RenderEngine * render_engine = 0;
+
+void create_default_engine()
+{
+  render_engine = new_REDirect();  // The default rendering engine
+}
+
+int find_engine(const string & name)
+{
+  // Cleanup old engine
+
+  delete render_engine;
+
+  // Find new engine
+  if(name == "direct")
+    render_engine = new_REDirect();
+  else
+    {
+      // Can't be found
+      render_engine = new_REDirect(); // Default
+      return RD_INPUT_UNKNOWN_ENGINE;
+    }
+
+  if(render_engine == 0) // Couldn't allocate
+    render_engine = new_REDirect();  // Default
+
+  return RD_OK;
+}
+
+void release_engine()
+{
+  delete render_engine;
+}
+
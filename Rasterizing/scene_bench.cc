@@ -0,0 +1,371 @@
+// Scene benchmark (make bench)
+// Renders .rd scenes headlessly with an rd_view a few times each and prints how long they took as JSON:
+// median and 95th percentile ms a frame, Mpixels/s, and the peak RSS of the renderer.
+// The first run of every scene saves its frames as ppm files (in a temporary directory), and their checksums are
+// checked against the golden ones so performance work can't quietly change the pictures.
+//
+// scene_bench [--golden FILE] [--update] [--images DIR] {[--psnr DB] [--view RD_VIEW] [--display TYPE] [--repeat N] [--options LINES] scene.rd ...}
+//   --golden FILE   Checksums of every frame ("<scene> <frame> <checksum>" lines) to check against
+//   --update        Write FILE (and DIR) from one run of every scene instead of checking against it (nothing is timed)
+//   --images DIR    Golden frames as ppm files. A frame whose checksum doesn't match still passes
+//                   if its PSNR against the golden frame is at least --psnr (default 50 dB, for the scenes after it).
+//                   A frame that matches is saved there if it isn't yet, so the golden frames don't have to be kept around:
+//                   a default run of a scene first makes them for the runs of it with --options after it
+//   --view RD_VIEW  Renderer for the scenes after it (default ./rd_view)
+//   --display TYPE  Display type of the timed runs of the scenes after it (default PNM, Memory leaves out writing files)
+//   --repeat N      Timed runs of each of the scenes after it (default 5)
+//   --options LINES Lines put in front of the Display line of the scenes after it, separated by ; (default none)
+//                   e.g. --options 'OptionBool "Tiled" on;OptionReal "Threads" 4'. The frames are still checked against
+//                   the scene's own golden ones, so a rendering mode can be held to the default pictures.
+// The JSON goes to stdout, progress to stderr. Exits with 1 if a frame didn't match or a scene failed to render.
+//
+// Checksums are 64 bit FNV-1a over the pixels (the same as Display "name" "Memory" "checksum" prints).
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct frame_image {
+    int number, width, height;
+    std::vector<unsigned char> pixels;
+};
+
+struct scene_result {
+    std::string scene, view, display, options, image = "unchecked"; // image: match, psnr, mismatch, missing, unchecked or failed
+    int frames = 0, width = 0, height = 0;
+    double median_ms = 0, p95_ms = 0, mpixels_per_s = 0, worst_psnr = INFINITY;
+    long peak_rss_kb = 0;
+};
+
+static unsigned long long checksum(const std::vector<unsigned char>& data) {
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static std::string hex(unsigned long long n) {
+    char text[17];
+    std::snprintf(text, sizeof text, "%016llx", n);
+    return text;
+}
+
+static bool read_file(const std::string& path, std::string& contents) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return false;
+    std::stringstream ss;
+    ss << file.rdbuf();
+    contents = ss.str();
+    return true;
+}
+
+// Binary ppm (P6, 255) like pnm_display.cc writes
+static bool read_ppm(const std::string& path, frame_image& image) {
+    std::string data;
+    if (!read_file(path, data)) return false;
+    std::istringstream header(data);
+    std::string magic;
+    int max;
+    if (!(header >> magic >> image.width >> image.height >> max) || magic != "P6" || max != 255) return false;
+    const size_t START = (size_t)header.tellg() + 1, SIZE = (size_t)image.width * image.height * 3;
+    if (data.size() < START + SIZE) return false;
+    image.pixels.assign(data.begin() + START, data.begin() + START + SIZE);
+    return true;
+}
+
+static bool write_ppm(const std::string& path, const frame_image& image) {
+    std::ofstream ppm(path, std::ios::binary);
+    ppm << "P6\n" << image.width << ' ' << image.height << "\n255\n";
+    ppm.write((const char*)image.pixels.data(), image.pixels.size());
+    return (bool)ppm;
+}
+
+static double psnr(const frame_image& a, const frame_image& b) {
+    if (a.width != b.width || a.height != b.height) return 0;
+    double error = 0;
+    for (size_t i = 0; i < a.pixels.size(); i++) {
+        const double D = (double)a.pixels[i] - b.pixels[i];
+        error += D*D;
+    }
+    if (error == 0) return INFINITY;
+    return 10 * std::log10(255.0*255.0 / (error / a.pixels.size()));
+}
+
+// The scene with its Display line swapped for one into "frame" with this display type (empty if it has none),
+// and the ; separated option lines in front of it
+static std::string headless_scene(const std::string& scene, const std::string& type, const std::string& options) {
+    std::istringstream in(scene);
+    std::string out, line;
+    bool replaced = false;
+    while (std::getline(in, line)) {
+        const size_t FIRST = line.find_first_not_of(" \t");
+        if (!replaced && FIRST != std::string::npos && line.compare(FIRST, 7, "Display") == 0) {
+            std::string option;
+            for (std::istringstream lines(options); std::getline(lines, option, ';');)
+                out += option + '\n';
+            line = "Display \"frame\" \"" + type + "\" \"rgb\"";
+            replaced = true;
+        }
+        out += line + '\n';
+    }
+    return replaced ? out : "";
+}
+
+// Runs view on file inside of directory (where its frames get saved), returns the seconds it took or -1 if it failed
+static double run(const std::string& view, const std::string& directory, const std::string& file, long& peak_rss_kb) {
+    const auto START = std::chrono::steady_clock::now();
+    const pid_t CHILD = fork();
+    if (CHILD < 0) return -1;
+    if (CHILD == 0) {
+        if (chdir(directory.c_str()) != 0) _exit(127);
+        const int NUL = open("/dev/null", O_WRONLY);
+        dup2(NUL, STDOUT_FILENO);
+        dup2(NUL, STDERR_FILENO);
+        execl(view.c_str(), view.c_str(), file.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(CHILD, &status, 0, &usage) < 0) return -1;
+    const double SECONDS = std::chrono::duration<double>(std::chrono::steady_clock::now() - START).count();
+    peak_rss_kb = std::max(peak_rss_kb, usage.ru_maxrss);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? SECONDS : -1;
+}
+
+// Every frame_<n>.ppm in directory, in frame order (and deletes them)
+static std::vector<frame_image> take_frames(const std::string& directory) {
+    std::vector<frame_image> frames;
+    DIR* dir = opendir(directory.c_str());
+    if (!dir) return frames;
+    for (struct dirent* entry; (entry = readdir(dir));) {
+        int number;
+        char end;
+        if (std::sscanf(entry->d_name, "frame_%d.pp%c", &number, &end) != 2 || end != 'm') continue;
+        const std::string PATH = directory + "/" + entry->d_name;
+        frame_image image;
+        image.number = number;
+        if (read_ppm(PATH, image)) frames.push_back(image);
+        std::remove(PATH.c_str());
+    }
+    closedir(dir);
+    std::sort(frames.begin(), frames.end(), [](const frame_image& a, const frame_image& b) { return a.number < b.number; });
+    return frames;
+}
+
+// "../Raytracing/Input/r56.rd" to "Raytracing_Input_r56" (for the golden image file names)
+static std::string flat_name(std::string scene) {
+    while (scene.compare(0, 2, "./") == 0 || scene.compare(0, 3, "../") == 0)
+        scene.erase(0, scene.find('/') + 1);
+    if (scene.size() > 3 && scene.compare(scene.size() - 3, 3, ".rd") == 0)
+        scene.erase(scene.size() - 3);
+    std::replace(scene.begin(), scene.end(), '/', '_');
+    return scene;
+}
+
+// Nearest rank percentile of sorted
+static double percentile(const std::vector<double>& sorted, double p) {
+    const size_t RANK = (size_t)std::ceil(p / 100 * sorted.size());
+    return sorted[std::min(sorted.size(), std::max<size_t>(RANK, 1)) - 1];
+}
+
+static std::string json_string(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out + '"';
+}
+
+static std::string json_number(double n) {
+    if (!std::isfinite(n)) return "null";
+    char text[32];
+    std::snprintf(text, sizeof text, "%.3f", n);
+    return text;
+}
+
+int main(int argc, char* argv[]) {
+    std::string golden_file, images_dir, view = "./rd_view", display = "PNM", options;
+    bool update = false;
+    double min_psnr = 50;
+    int repeat = 5;
+    std::vector<scene_result> results;
+    std::vector<int> repeats;
+    std::vector<double> min_psnrs;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string ARG = argv[i];
+        const bool VALUE = i + 1 < argc;
+        if      (ARG == "--golden"  && VALUE) golden_file = argv[++i];
+        else if (ARG == "--images"  && VALUE) images_dir = argv[++i];
+        else if (ARG == "--psnr"    && VALUE) min_psnr = std::atof(argv[++i]);
+        else if (ARG == "--view"    && VALUE) view = argv[++i];
+        else if (ARG == "--display" && VALUE) display = argv[++i];
+        else if (ARG == "--repeat"  && VALUE) repeat = std::max(1, std::atoi(argv[++i]));
+        else if (ARG == "--options" && VALUE) options = argv[++i];
+        else if (ARG == "--update") update = true;
+        else if (ARG.compare(0, 2, "--") == 0) {
+            std::cerr << "scene_bench: unknown option " << ARG << " (see the top of scene_bench.cc)" << std::endl;
+            return 2;
+        } else {
+            scene_result result;
+            result.scene = ARG;
+            result.view = view;
+            result.display = display;
+            result.options = options;
+            results.push_back(result);
+            repeats.push_back(repeat);
+            min_psnrs.push_back(min_psnr);
+        }
+    }
+
+    // Golden checksums, by "<scene> <frame>"
+    std::map<std::string, std::string> golden;
+    if (!golden_file.empty() && !update) {
+        std::ifstream in(golden_file);
+        std::string scene, checksum;
+        int frame;
+        while (in >> scene >> frame >> checksum)
+            golden[scene + " " + std::to_string(frame)] = checksum;
+    }
+    std::ostringstream updated; // The golden file written with --update
+
+    char directory[] = "/tmp/scene_bench.XXXXXX";
+    if (!mkdtemp(directory)) {
+        std::cerr << "scene_bench: couldn't make a temporary directory" << std::endl;
+        return 2;
+    }
+
+    bool passed = true;
+    for (size_t s = 0; s < results.size(); s++) {
+        scene_result& result = results[s];
+        std::cerr << result.scene << (result.options.empty() ? "" : " (" + result.options + ")") << ": " << std::flush;
+
+        char view_path[PATH_MAX];
+        std::string scene;
+        std::string check, timed;
+        if (!realpath(result.view.c_str(), view_path) || !read_file(result.scene, scene) ||
+            (check = headless_scene(scene, "PNM", result.options)).empty() || (timed = headless_scene(scene, result.display, result.options)).empty()) {
+            std::cerr << "can't read it, its Display line or " << result.view << std::endl;
+            result.image = "failed";
+            passed = false;
+            continue;
+        }
+        std::ofstream(std::string(directory) + "/check.rd") << check;
+        std::ofstream(std::string(directory) + "/timed.rd") << timed;
+
+        // First run: the frames to check
+        long check_rss_kb = 0; // Only the timed runs count
+        if (run(view_path, directory, "check.rd", check_rss_kb) < 0) {
+            std::cerr << "failed to render" << std::endl;
+            result.image = "failed";
+            passed = false;
+            continue;
+        }
+        const std::vector<frame_image> FRAMES = take_frames(directory);
+        result.frames = FRAMES.size();
+        long long pixels = 0;
+        for (const frame_image& frame : FRAMES) pixels += (long long)frame.width * frame.height;
+        if (!FRAMES.empty()) {
+            result.width = FRAMES[0].width;
+            result.height = FRAMES[0].height;
+        }
+
+        for (const frame_image& frame : FRAMES) {
+            const std::string KEY = result.scene + " " + std::to_string(frame.number);
+            const std::string SUM = hex(checksum(frame.pixels));
+            const std::string IMAGE = images_dir + "/" + flat_name(result.scene) + "_" + std::to_string(frame.number) + ".ppm";
+            if (update) {
+                updated << KEY << " " << SUM << "\n";
+                if (!images_dir.empty()) write_ppm(IMAGE, frame);
+                continue;
+            }
+            if (golden_file.empty()) continue;
+
+            std::string status = "match";
+            const auto GOLDEN = golden.find(KEY);
+            frame_image expected;
+            if (GOLDEN == golden.end())
+                status = "missing";
+            else if (GOLDEN->second == SUM) {
+                if (!images_dir.empty() && access(IMAGE.c_str(), F_OK) != 0) write_ppm(IMAGE, frame); // For the PSNR of the runs after it
+            } else {
+                const double PSNR = !images_dir.empty() && read_ppm(IMAGE, expected) ? psnr(frame, expected) : -INFINITY; // null in the JSON without a golden frame
+                result.worst_psnr = std::min(result.worst_psnr, PSNR);
+                status = PSNR >= min_psnrs[s] ? "psnr" : "mismatch";
+            }
+            // The scene is as bad as its worst frame
+            const char* ORDER[] = {"unchecked", "match", "psnr", "missing", "mismatch"};
+            auto rank = [&](const std::string& name) { return std::find(ORDER, ORDER + 5, name) - ORDER; };
+            if (rank(status) > rank(result.image)) result.image = status;
+        }
+        if (result.image == "missing" || result.image == "mismatch") passed = false;
+
+        if (update) {
+            std::cerr << result.frames << " frames" << std::endl;
+            continue;
+        }
+
+        // Timed runs
+        std::vector<double> ms_per_frame;
+        for (int r = 0; r < repeats[s]; r++) {
+            const double SECONDS = run(view_path, directory, "timed.rd", result.peak_rss_kb);
+            take_frames(directory); // Only to clean up after PNM
+            if (SECONDS < 0) break;
+            ms_per_frame.push_back(SECONDS * 1000 / std::max(1, result.frames));
+        }
+        if (ms_per_frame.size() < (size_t)repeats[s]) {
+            std::cerr << "failed to render with the " << result.display << " display" << std::endl;
+            result.image = "failed";
+            passed = false;
+            continue;
+        }
+        std::sort(ms_per_frame.begin(), ms_per_frame.end());
+        result.median_ms = percentile(ms_per_frame, 50);
+        result.p95_ms = percentile(ms_per_frame, 95);
+        result.mpixels_per_s = result.frames ? pixels / (result.median_ms * result.frames / 1000) / 1e6 : 0;
+
+        std::cerr << result.frames << " frames, " << result.median_ms << " ms a frame (p95 " << result.p95_ms << "), "
+                  << result.mpixels_per_s << " Mpixels/s, " << result.peak_rss_kb << " KB, image " << result.image << std::endl;
+    }
+
+    std::remove((std::string(directory) + "/check.rd").c_str());
+    std::remove((std::string(directory) + "/timed.rd").c_str());
+    rmdir(directory);
+
+    if (update && !golden_file.empty()) {
+        std::ofstream(golden_file) << updated.str();
+        std::cerr << "Wrote " << golden_file << std::endl;
+    }
+
+    std::cout << "{\n  \"scenes\": [";
+    for (size_t s = 0; s < results.size(); s++) {
+        const scene_result& r = results[s];
+        std::cout << (s ? "," : "") << "\n    {\"scene\": " << json_string(r.scene) << ", \"view\": " << json_string(r.view)
+                  << ", \"display\": " << json_string(r.display) << ", \"options\": " << json_string(r.options) << ", \"repeat\": " << repeats[s]
+                  << ", \"frames\": " << r.frames << ", \"width\": " << r.width << ", \"height\": " << r.height
+                  << ", \"median_ms_per_frame\": " << json_number(r.median_ms) << ", \"p95_ms_per_frame\": " << json_number(r.p95_ms)
+                  << ", \"mpixels_per_s\": " << json_number(r.mpixels_per_s) << ", \"peak_rss_kb\": " << r.peak_rss_kb
+                  << ", \"image\": " << json_string(r.image) << ", \"worst_psnr_db\": " << json_number(r.worst_psnr) << "}";
+    }
+    std::cout << "\n  ],\n  \"passed\": " << (passed ? "true" : "false") << "\n}" << std::endl;
+    return passed ? 0 : 1;
+}
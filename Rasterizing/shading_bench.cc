@@ -0,0 +1,116 @@
+// Microbenchmark for shade_span
+// Lights a big pile of random fragments with 4 far lights and 4 point lights (plastic, so diffuse and specular both run)
+// with every span kernel this CPU can run, checks they all give the same colors,
+// and checks how far span_pow() is from std::pow for the specular exponents rd_specular_color can give.
+//
+// make shading_bench && ./shading_bench [number of fragments] [repeats]
+#include "span_shading.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static float random(float low, float high) {
+    return low + (float)std::rand() / RAND_MAX * (high - low);
+}
+
+int main(int argc, char* argv[]) {
+    const int COUNT   = argc > 1 ? std::atoi(argv[1]) : 1000000;
+    const int REPEATS = argc > 2 ? std::atoi(argv[2]) : 5;
+    std::srand(631);
+
+    // span_pow() against std::pow
+    // (angles are cosines, so only 0 to 1 matters)
+    double worst = 0; float worst_x = 0; int worst_exponent = 0;
+    for (int exponent = 0; exponent <= 256; exponent++) {
+        for (int i = 1; i <= 10000; i++) {
+            const float x = i / 10000.0f;
+            const float EXPECTED = std::pow(x, (float)exponent);
+            if (EXPECTED < 1e-30f) continue; // Tiny enough to be 0 as a color either way
+            const double ERROR = std::fabs((double)span_pow(x, exponent) - EXPECTED) / EXPECTED;
+            if (ERROR > worst) { worst = ERROR; worst_x = x; worst_exponent = exponent; }
+        }
+    }
+    std::cout << "span_pow vs std::pow, worst relative error: " << worst << " (" << worst_x << "^" << worst_exponent << ")\n";
+
+    // Lights
+    span_lights lights;
+    for (int l = 0; l < 4; l++) {
+        float dir[3] = {random(-1, 1), random(-1, 1), random(-2, -1)};
+        const float LENGTH = std::sqrt(dir[0]*dir[0] + dir[1]*dir[1] + dir[2]*dir[2]);
+        dir[0] /= LENGTH; dir[1] /= LENGTH; dir[2] /= LENGTH;
+        const float pos[3] = {random(-10, 10), random(-10, 10), random(5, 15)};
+        const float rgb[3] = {random(0, 1), random(0, 1), random(0, 1)};
+        lights.add_far(dir, rgb);
+        lights.add_point(pos, rgb);
+    }
+
+    span_material material;
+    material.model = SPAN_PLASTIC;
+    for (int c = 0; c < 3; c++) {
+        material.surface_color[c] = random(0, 1);
+        material.specular_color[c] = 1;
+        material.ambience[c] = 0.1f;
+        material.eye[c] = 0;
+    }
+    material.eye[2] = 20;
+    material.diffuse_coefficient = 0.7f;
+    material.specular_coefficient = 0.5f;
+    material.specular_exponent = 50;
+
+    // Fragments, in batches like the rasterizer sends them
+    std::vector<span_fragments> batches((COUNT + SPAN_SIZE - 1) / SPAN_SIZE);
+    for (size_t b = 0; b < batches.size(); b++) {
+        span_fragments& f = batches[b];
+        f.count = std::min(SPAN_SIZE, COUNT - (int)b*SPAN_SIZE);
+        for (int i = 0; i < f.count; i++) {
+            // Normals facing the eye (mostly), on a surface between it and the lights
+            f.nx[i] = random(-0.5f, 0.5f); f.ny[i] = random(-0.5f, 0.5f); f.nz[i] = 1;
+            const float LENGTH = std::sqrt(f.nx[i]*f.nx[i] + f.ny[i]*f.ny[i] + 1);
+            f.nx[i] /= LENGTH; f.ny[i] /= LENGTH; f.nz[i] /= LENGTH;
+            f.px[i] = random(-5, 5); f.py[i] = random(-5, 5); f.pz[i] = random(-1, 1);
+        }
+    }
+
+    // Every span kernel this CPU has, scalar first so the rest can be checked against it
+    std::vector<float> expected;
+    const char* KERNELS[] = {"scalar", "avx"};
+    for (const char* kernel : KERNELS) {
+        if (!span_kernel(kernel)) {
+            std::cout << kernel << ": not supported\n";
+            continue;
+        }
+
+        double best = 1e30;
+        for (int r = 0; r < REPEATS; r++) {
+            const auto START = std::chrono::steady_clock::now();
+            for (span_fragments& f : batches)
+                shade_span(lights, material, f);
+            best = std::min(best, seconds_since(START));
+        }
+
+        std::vector<float> colors;
+        for (const span_fragments& f : batches)
+            for (int i = 0; i < f.count; i++) {
+                colors.push_back(f.r[i]); colors.push_back(f.g[i]); colors.push_back(f.b[i]);
+            }
+        int mismatches = 0;
+        if (expected.empty())
+            expected = colors;
+        else
+            for (size_t i = 0; i < colors.size(); i++)
+                if (colors[i] != expected[i] && !(std::isnan(colors[i]) && std::isnan(expected[i])))
+                    mismatches++;
+
+        std::cout << kernel << ": " << best*1000 << " ms (" << COUNT / best / 1e6 << " Mfragments/s)"
+                  << (mismatches ? ", MISMATCHES: " : "") << (mismatches ? std::to_string(mismatches) : "") << "\n";
+        if (mismatches) return 1;
+    }
+    return 0;
+}
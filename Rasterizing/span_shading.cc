@@ -0,0 +1,313 @@
+#include "span_shading.h"
+
+#include <cmath>
+#include <cstring> // strcmp for span_kernel(name)
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // AVX (only used inside functions marked for it, picked at runtime)
+#define SPAN_X86
+#endif
+
+
+void span_lights::clear() {
+    far_x.clear(); far_y.clear(); far_z.clear(); far_r.clear(); far_g.clear(); far_b.clear();
+    point_x.clear(); point_y.clear(); point_z.clear(); point_r.clear(); point_g.clear(); point_b.clear();
+}
+void span_lights::add_far(const float xyz[3], const float rgb[3]) {
+    far_x.push_back(xyz[0]); far_y.push_back(xyz[1]); far_z.push_back(xyz[2]);
+    far_r.push_back(rgb[0]); far_g.push_back(rgb[1]); far_b.push_back(rgb[2]);
+}
+void span_lights::add_point(const float xyz[3], const float rgb[3]) {
+    point_x.push_back(xyz[0]); point_y.push_back(xyz[1]); point_z.push_back(xyz[2]);
+    point_r.push_back(rgb[0]); point_g.push_back(rgb[1]); point_b.push_back(rgb[2]);
+}
+
+// Whole number exponents get squared up bit by bit (x^10 = x^2 * x^8), everything else goes to std::pow
+static bool pow_by_squaring(float exponent) {
+    return exponent >= 0 && exponent <= SPAN_POW_MAX && exponent == std::floor(exponent);
+}
+
+float span_pow(float x, float exponent) {
+    if (!pow_by_squaring(exponent))
+        return std::pow(x, exponent);
+
+    float result = 1.0f;
+    for (int n = (int)exponent; n; ) {
+        if (n & 1) result *= x;
+        n >>= 1;
+        if (n) x *= x; // Not past the last bit (small angles would square down into slow denormals for nothing)
+    }
+    return result;
+}
+
+
+// Kernels
+// Each one does the same float operations in the same order as the shaders (and each other), just on more fragments at a time.
+namespace {
+typedef void (*span_function)(const span_lights& lights, const span_material& m, span_fragments& f, int first, int last);
+
+// Plain floats (any CPU, and the leftovers of AVX)
+void span_scalar(const span_lights& lights, const span_material& m, span_fragments& f, int first, int last) {
+    const bool DIFFUSE = m.model != SPAN_METAL, SPECULAR = m.model != SPAN_MATTE;
+    const int FARS = lights.far_x.size(), POINTS = lights.point_x.size();
+
+    for (int i = first; i < last; i++) {
+        const float NX = f.nx[i], NY = f.ny[i], NZ = f.nz[i];
+        const float PX = f.px[i], PY = f.py[i], PZ = f.pz[i];
+
+        // get_diffusion()
+        float diffuse[3] = {0, 0, 0};
+        if (DIFFUSE) {
+            for (int l = 0; l < FARS; l++) {
+                const float angle = NX*(-lights.far_x[l]) + NY*(-lights.far_y[l]) + NZ*(-lights.far_z[l]);
+                if (angle <= 0) continue;
+                diffuse[0] += angle * lights.far_r[l];
+                diffuse[1] += angle * lights.far_g[l];
+                diffuse[2] += angle * lights.far_b[l];
+            }
+            for (int l = 0; l < POINTS; l++) {
+                const float LX = lights.point_x[l] - PX, LY = lights.point_y[l] - PY, LZ = lights.point_z[l] - PZ;
+                const float LENGTH = std::sqrt(LX*LX + LY*LY + LZ*LZ);
+                const float angle = NX*(LX/LENGTH) + NY*(LY/LENGTH) + NZ*(LZ/LENGTH);
+                if (angle <= 0) continue;
+                const float I = angle / (LX*LX + LY*LY + LZ*LZ);
+                diffuse[0] += I * lights.point_r[l];
+                diffuse[1] += I * lights.point_g[l];
+                diffuse[2] += I * lights.point_b[l];
+            }
+            diffuse[0] *= m.diffuse_coefficient;
+            diffuse[1] *= m.diffuse_coefficient;
+            diffuse[2] *= m.diffuse_coefficient;
+        }
+
+        // get_specular()
+        float specular[3] = {0, 0, 0};
+        if (SPECULAR) {
+            const float VX = PX - m.eye[0], VY = PY - m.eye[1], VZ = PZ - m.eye[2];
+            const float VLENGTH = std::sqrt(VX*VX + VY*VY + VZ*VZ);
+            const float vx = VX/VLENGTH, vy = VY/VLENGTH, vz = VZ/VLENGTH;
+
+            for (int l = 0; l < FARS + POINTS; l++) {
+                // Light direction (far lights are already normalized), and 1/r^2 for point lights
+                float lx, ly, lz, falloff = 1.0f;
+                float r, g, b;
+                if (l < FARS) {
+                    lx = lights.far_x[l]; ly = lights.far_y[l]; lz = lights.far_z[l];
+                    r = lights.far_r[l]; g = lights.far_g[l]; b = lights.far_b[l];
+                } else {
+                    const int P = l - FARS;
+                    const float LX = PX - lights.point_x[P], LY = PY - lights.point_y[P], LZ = PZ - lights.point_z[P];
+                    const float LENGTH = std::sqrt(LX*LX + LY*LY + LZ*LZ);
+                    lx = LX/LENGTH; ly = LY/LENGTH; lz = LZ/LENGTH;
+                    falloff = 1.f / (LX*LX + LY*LY + LZ*LZ);
+                    r = lights.point_r[P]; g = lights.point_g[P]; b = lights.point_b[P];
+                }
+
+                // reflect()
+                float a = NX*lx + NY*ly + NZ*lz;
+                if (a >= 0.f) a = 1.f;
+                const float K = 2*a;
+                const float RX = NX*K - lx, RY = NY*K - ly, RZ = NZ*K - lz;
+                const float RLENGTH = std::sqrt(RX*RX + RY*RY + RZ*RZ);
+
+                const float angle = vx*(RX/RLENGTH) + vy*(RY/RLENGTH) + vz*(RZ/RLENGTH);
+                if (angle <= 0.f) continue;
+                const float I = l < FARS ? span_pow(angle, m.specular_exponent) : falloff * span_pow(angle, m.specular_exponent);
+                specular[0] += I * r;
+                specular[1] += I * g;
+                specular[2] += I * b;
+            }
+            specular[0] *= m.specular_coefficient;
+            specular[1] *= m.specular_coefficient;
+            specular[2] *= m.specular_coefficient;
+        }
+
+        // matte(), metal() or plastic()
+        float color[3];
+        for (int c = 0; c < 3; c++) {
+            switch (m.model) {
+            case SPAN_MATTE:   color[c] = m.surface_color[c] * (m.ambience[c] + diffuse[c]); break;
+            case SPAN_METAL:   color[c] = m.surface_color[c] * (m.ambience[c] + specular[c]); break;
+            case SPAN_PLASTIC: color[c] = m.surface_color[c] * (m.ambience[c] + diffuse[c]) + m.specular_color[c] * specular[c]; break;
+            }
+            color[c] = color[c] > 1.f ? 1.f : color[c]; // clamp_down3()
+        }
+        f.r[i] = color[0]; f.g[i] = color[1]; f.b[i] = color[2];
+    }
+}
+
+#ifdef SPAN_X86
+// AVX, 8 fragments at a time
+// The "if (angle <= 0) continue;"s become masks, lanes that would have skipped a light keep what they had.
+__attribute__((target("avx"))) inline __m256 length_avx(__m256 x, __m256 y, __m256 z) {
+    return _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z)));
+}
+__attribute__((target("avx"))) inline __m256 dot_avx(__m256 x1, __m256 y1, __m256 z1, __m256 x2, __m256 y2, __m256 z2) {
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x1, x2), _mm256_mul_ps(y1, y2)), _mm256_mul_ps(z1, z2));
+}
+// acc += (mask ? I * rgb : nothing)
+__attribute__((target("avx"))) inline void accumulate_avx(__m256 acc[3], __m256 mask, __m256 I, float r, float g, float b) {
+    acc[0] = _mm256_blendv_ps(acc[0], _mm256_add_ps(acc[0], _mm256_mul_ps(I, _mm256_set1_ps(r))), mask);
+    acc[1] = _mm256_blendv_ps(acc[1], _mm256_add_ps(acc[1], _mm256_mul_ps(I, _mm256_set1_ps(g))), mask);
+    acc[2] = _mm256_blendv_ps(acc[2], _mm256_add_ps(acc[2], _mm256_mul_ps(I, _mm256_set1_ps(b))), mask);
+}
+__attribute__((target("avx"))) inline __m256 pow_avx(__m256 x, float exponent) {
+    if (!pow_by_squaring(exponent)) { // One lane at a time
+        float lanes[8];
+        _mm256_storeu_ps(lanes, x);
+        for (float& lane : lanes)
+            lane = span_pow(lane, exponent);
+        return _mm256_loadu_ps(lanes);
+    }
+
+    __m256 result = _mm256_set1_ps(1.0f);
+    for (int n = (int)exponent; n; ) {
+        if (n & 1) result = _mm256_mul_ps(result, x);
+        n >>= 1;
+        if (n) x = _mm256_mul_ps(x, x);
+    }
+    return result;
+}
+
+__attribute__((target("avx"))) void span_avx(const span_lights& lights, const span_material& m, span_fragments& f, int first, int last) {
+    const bool DIFFUSE = m.model != SPAN_METAL, SPECULAR = m.model != SPAN_MATTE;
+    const int FARS = lights.far_x.size(), POINTS = lights.point_x.size();
+    const __m256 ZERO = _mm256_setzero_ps(), ONE = _mm256_set1_ps(1.0f), TWO = _mm256_set1_ps(2.0f);
+
+    int i = first;
+    for (; i + 8 <= last; i += 8) {
+        const __m256 NX = _mm256_loadu_ps(f.nx + i), NY = _mm256_loadu_ps(f.ny + i), NZ = _mm256_loadu_ps(f.nz + i);
+        const __m256 PX = _mm256_loadu_ps(f.px + i), PY = _mm256_loadu_ps(f.py + i), PZ = _mm256_loadu_ps(f.pz + i);
+
+        // get_diffusion()
+        __m256 diffuse[3] = {ZERO, ZERO, ZERO};
+        if (DIFFUSE) {
+            for (int l = 0; l < FARS; l++) {
+                const __m256 angle = dot_avx(NX, NY, NZ, _mm256_set1_ps(-lights.far_x[l]), _mm256_set1_ps(-lights.far_y[l]), _mm256_set1_ps(-lights.far_z[l]));
+                accumulate_avx(diffuse, _mm256_cmp_ps(angle, ZERO, _CMP_GT_OQ), angle, lights.far_r[l], lights.far_g[l], lights.far_b[l]);
+            }
+            for (int l = 0; l < POINTS; l++) {
+                const __m256 LX = _mm256_sub_ps(_mm256_set1_ps(lights.point_x[l]), PX);
+                const __m256 LY = _mm256_sub_ps(_mm256_set1_ps(lights.point_y[l]), PY);
+                const __m256 LZ = _mm256_sub_ps(_mm256_set1_ps(lights.point_z[l]), PZ);
+                const __m256 LENGTH = length_avx(LX, LY, LZ);
+                const __m256 angle = dot_avx(NX, NY, NZ, _mm256_div_ps(LX, LENGTH), _mm256_div_ps(LY, LENGTH), _mm256_div_ps(LZ, LENGTH));
+                const __m256 I = _mm256_div_ps(angle, dot_avx(LX, LY, LZ, LX, LY, LZ));
+                accumulate_avx(diffuse, _mm256_cmp_ps(angle, ZERO, _CMP_GT_OQ), I, lights.point_r[l], lights.point_g[l], lights.point_b[l]);
+            }
+            const __m256 KD = _mm256_set1_ps(m.diffuse_coefficient);
+            for (__m256& d : diffuse) d = _mm256_mul_ps(d, KD);
+        }
+
+        // get_specular()
+        __m256 specular[3] = {ZERO, ZERO, ZERO};
+        if (SPECULAR) {
+            const __m256 VX = _mm256_sub_ps(PX, _mm256_set1_ps(m.eye[0]));
+            const __m256 VY = _mm256_sub_ps(PY, _mm256_set1_ps(m.eye[1]));
+            const __m256 VZ = _mm256_sub_ps(PZ, _mm256_set1_ps(m.eye[2]));
+            const __m256 VLENGTH = length_avx(VX, VY, VZ);
+            const __m256 vx = _mm256_div_ps(VX, VLENGTH), vy = _mm256_div_ps(VY, VLENGTH), vz = _mm256_div_ps(VZ, VLENGTH);
+
+            for (int l = 0; l < FARS + POINTS; l++) {
+                __m256 lx, ly, lz, falloff = ONE;
+                float r, g, b;
+                if (l < FARS) {
+                    lx = _mm256_set1_ps(lights.far_x[l]); ly = _mm256_set1_ps(lights.far_y[l]); lz = _mm256_set1_ps(lights.far_z[l]);
+                    r = lights.far_r[l]; g = lights.far_g[l]; b = lights.far_b[l];
+                } else {
+                    const int P = l - FARS;
+                    const __m256 LX = _mm256_sub_ps(PX, _mm256_set1_ps(lights.point_x[P]));
+                    const __m256 LY = _mm256_sub_ps(PY, _mm256_set1_ps(lights.point_y[P]));
+                    const __m256 LZ = _mm256_sub_ps(PZ, _mm256_set1_ps(lights.point_z[P]));
+                    const __m256 LENGTH = length_avx(LX, LY, LZ);
+                    lx = _mm256_div_ps(LX, LENGTH); ly = _mm256_div_ps(LY, LENGTH); lz = _mm256_div_ps(LZ, LENGTH);
+                    falloff = _mm256_div_ps(ONE, dot_avx(LX, LY, LZ, LX, LY, LZ));
+                    r = lights.point_r[P]; g = lights.point_g[P]; b = lights.point_b[P];
+                }
+
+                // reflect()
+                __m256 a = dot_avx(NX, NY, NZ, lx, ly, lz);
+                a = _mm256_blendv_ps(a, ONE, _mm256_cmp_ps(a, ZERO, _CMP_GE_OQ));
+                const __m256 K = _mm256_mul_ps(TWO, a);
+                const __m256 RX = _mm256_sub_ps(_mm256_mul_ps(NX, K), lx);
+                const __m256 RY = _mm256_sub_ps(_mm256_mul_ps(NY, K), ly);
+                const __m256 RZ = _mm256_sub_ps(_mm256_mul_ps(NZ, K), lz);
+                const __m256 RLENGTH = length_avx(RX, RY, RZ);
+
+                const __m256 angle = dot_avx(vx, vy, vz, _mm256_div_ps(RX, RLENGTH), _mm256_div_ps(RY, RLENGTH), _mm256_div_ps(RZ, RLENGTH));
+                const __m256 MASK = _mm256_cmp_ps(angle, ZERO, _CMP_GT_OQ);
+                if (_mm256_testz_ps(MASK, MASK)) continue; // Every lane skips this light
+
+                // Lanes with angle <= 0 are thrown away, but keep them from going to pow() as garbage
+                const __m256 POW = pow_avx(_mm256_blendv_ps(ZERO, angle, MASK), m.specular_exponent);
+                const __m256 I = l < FARS ? POW : _mm256_mul_ps(falloff, POW);
+                accumulate_avx(specular, MASK, I, r, g, b);
+            }
+            const __m256 KS = _mm256_set1_ps(m.specular_coefficient);
+            for (__m256& s : specular) s = _mm256_mul_ps(s, KS);
+        }
+
+        // matte(), metal() or plastic()
+        float* OUT[3] = {f.r + i, f.g + i, f.b + i};
+        for (int c = 0; c < 3; c++) {
+            const __m256 SC = _mm256_set1_ps(m.surface_color[c]), AMBIENCE = _mm256_set1_ps(m.ambience[c]);
+            __m256 color;
+            switch (m.model) {
+            case SPAN_MATTE:   color = _mm256_mul_ps(SC, _mm256_add_ps(AMBIENCE, diffuse[c])); break;
+            case SPAN_METAL:   color = _mm256_mul_ps(SC, _mm256_add_ps(AMBIENCE, specular[c])); break;
+            default:           color = _mm256_add_ps(_mm256_mul_ps(SC, _mm256_add_ps(AMBIENCE, diffuse[c])),
+                                                     _mm256_mul_ps(_mm256_set1_ps(m.specular_color[c]), specular[c])); break;
+            }
+            color = _mm256_blendv_ps(color, ONE, _mm256_cmp_ps(color, ONE, _CMP_GT_OQ)); // clamp_down3()
+            _mm256_storeu_ps(OUT[c], color);
+        }
+    }
+    span_scalar(lights, m, f, i, last);
+}
+#endif
+
+// The kernels, best first
+struct span_choice { const char* name; span_function function; };
+const span_choice SPAN_KERNELS[] = {
+#ifdef SPAN_X86
+    {"avx", span_avx},
+#endif
+    {"scalar", span_scalar},
+};
+
+bool span_supported(const span_choice& k) {
+#ifdef SPAN_X86
+    if (k.function == span_avx) return __builtin_cpu_supports("avx");
+#endif
+    return true;
+}
+
+// Picked once, the first time it's needed
+const span_choice*& span_selected() {
+    static const span_choice* selected = nullptr;
+    if (!selected) {
+        for (const span_choice& k : SPAN_KERNELS) {
+            if (span_supported(k)) {
+                selected = &k;
+                break;
+            }
+        }
+    }
+    return selected;
+}
+}
+
+void shade_span(const span_lights& lights, const span_material& material, span_fragments& fragments) {
+    span_selected()->function(lights, material, fragments, 0, fragments.count);
+}
+const char* span_kernel() {
+    return span_selected()->name;
+}
+bool span_kernel(const char* name) {
+    for (const span_choice& k : SPAN_KERNELS) {
+        if (std::strcmp(k.name, name) == 0 && span_supported(k)) {
+            span_selected() = &k;
+            return true;
+        }
+    }
+    return false;
+}
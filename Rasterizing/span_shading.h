@@ -0,0 +1,55 @@
+#ifndef SPAN_SHADING_H
+#define SPAN_SHADING_H
+
+#include <vector>
+
+// Span shading (OptionBool "SpanShading")
+// Lights a whole batch of fragments at once instead of one pixel at a time through matte(), metal() or plastic().
+// Everything is split into arrays (all the x's together, all the y's together, ...) so 8 fragments can be lit at once with AVX.
+// The math is done in the same order as the shaders in rd_direct.cc so the colors come out bit for bit the same,
+// except for pow(angle, specular_exponent) which is done with multiplies instead (see span_pow()).
+
+#define SPAN_SIZE 64        // Most fragments shaded at once
+#define SPAN_POW_MAX 65536  // Biggest whole number exponent span_pow() does with multiplies
+
+// The lights, split into arrays (REDirect keeps these the same as far_lights and point_lights)
+struct span_lights {
+    std::vector<float> far_x, far_y, far_z, far_r, far_g, far_b;             // Direction (normalized) and color * intensity
+    std::vector<float> point_x, point_y, point_z, point_r, point_g, point_b; // Position and color * intensity
+
+    void clear();
+    void add_far(const float xyz[3], const float rgb[3]);
+    void add_point(const float xyz[3], const float rgb[3]);
+};
+
+enum span_model { SPAN_MATTE, SPAN_METAL, SPAN_PLASTIC }; // Which shader's math to do
+
+// Everything else the shaders read (constant for a polygon)
+struct span_material {
+    span_model model;
+    float surface_color[3], specular_color[3];
+    float ambience[3]; // ambient_coefficient * ambient_light
+    float diffuse_coefficient, specular_coefficient, specular_exponent;
+    float eye[3];      // camera_eye_position
+};
+
+// A batch of fragments. The World Space normal (not normalized, same as the shaders) and position go in, the color comes out.
+struct span_fragments {
+    int count;
+    float nx[SPAN_SIZE], ny[SPAN_SIZE], nz[SPAN_SIZE];
+    float px[SPAN_SIZE], py[SPAN_SIZE], pz[SPAN_SIZE];
+    float r[SPAN_SIZE], g[SPAN_SIZE], b[SPAN_SIZE]; // Clamped like the shaders
+};
+
+// Shades the fragments with the fastest kernel this CPU has
+void shade_span(const span_lights& lights, const span_material& material, span_fragments& fragments);
+
+// pow(x, exponent) the way shade_span() does it.
+// Whole number exponents from 0 to SPAN_POW_MAX are done with multiplies (squaring), anything else just calls std::pow.
+// The squaring is a few float roundings off of std::pow at most (run shading_bench to see how far).
+float span_pow(float x, float exponent);
+
+const char* span_kernel();          // Which kernel shade_span uses, picked at runtime for this CPU ("avx" or "scalar")
+bool span_kernel(const char* name); // Forces one of them (false if this CPU can't run it), mostly for benchmarking
+
+#endif /* SPAN_SHADING_H */
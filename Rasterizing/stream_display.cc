@@ -0,0 +1,83 @@
+#include <string>
+#include <iostream>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h> // open
+#include <unistd.h> // write, dup
+
+#include "stream_display.h"
+#include "pnm_display.h"
+#include "rd_display.h"
+#include "rd_error.h"
+
+// Stream display (Display "name" "Stream" "rgb")
+// Writes every finished frame as raw RGB24 (display_xSize*display_ySize pixels, 3 bytes each, top row first)
+// one after another into the file or named pipe called name, or to stdout if name is "-".
+// Everything is preceded by one header line, "RGB24 <width> <height>\n", so whatever reads it knows how big the frames are.
+// e.g. rd_view movie.rd | (head -n 1 >&2; ffmpeg -f rawvideo -pix_fmt rgb24 -s 640x480 -i - movie.mp4)
+//
+// The image itself is the PNM driver's (so drawing, reading and clearing are the same), only where it goes is different.
+// Each frame goes straight from display_pixels to the stream in one write(), no X11 needed.
+
+static int stream_fd = -1; // Where the frames go
+static bool stream_stdout = false; // stream_fd is the real stdout, and fd 1 points at stderr until the display ends
+
+// Writes all of data, a pipe can take less than asked for at a time (or be interrupted by a signal)
+static bool write_all(const unsigned char* data, size_t size) {
+    while (size > 0) {
+        const ssize_t WRITTEN = write(stream_fd, data, size);
+        if (WRITTEN < 0) {
+            if (errno == EINTR) continue; // Interrupted by a signal before anything was written, try again
+            return false;
+        }
+        data += WRITTEN;
+        size -= WRITTEN;
+    }
+    return true;
+}
+
+// Sets up the image like the PNM driver, opens the stream and writes the header
+int stream_init_display() {
+    const int ERR = pnm_init_display();
+    if (ERR) return ERR;
+
+    if (std::string(display_name) == "-") {
+        // The frames get stdout to themselves, anything else printed to it goes to stderr instead
+        // (only while the display is open, stream_end_display() puts stdout back)
+        std::cout.flush();
+        std::fflush(stdout);
+        stream_fd = dup(STDOUT_FILENO);
+        stream_stdout = stream_fd >= 0 && dup2(STDERR_FILENO, STDOUT_FILENO) >= 0;
+    } else
+        stream_fd = open(display_name, O_WRONLY | O_CREAT | O_TRUNC, 0644); // A named pipe just blocks here until something reads it
+
+    if (stream_fd < 0) return RD_INPUT_DISPLAY_INITIALIZATION_ERROR;
+
+    const std::string HEADER = "RGB24 " + std::to_string(display_xSize) + ' ' + std::to_string(display_ySize) + '\n';
+    if (!write_all((const unsigned char*)HEADER.data(), HEADER.size()))
+        return RD_INPUT_DISPLAY_INITIALIZATION_ERROR;
+
+    return RD_OK;
+}
+
+// Called when the input file is finished
+int stream_end_display() {
+    if (stream_stdout) { // Whatever was printed in the meantime goes out to stderr first
+        std::cout.flush();
+        std::fflush(stdout);
+        dup2(stream_fd, STDOUT_FILENO);
+        stream_stdout = false;
+    }
+    if (stream_fd >= 0) close(stream_fd);
+    stream_fd = -1;
+    return pnm_end_display();
+}
+
+// Sends the finished frame down the stream (an error if it couldn't, e.g. whatever was reading it went away)
+int stream_end_frame() {
+    if (!write_all(display_pixels, (size_t)display_xSize * display_ySize * 3)) {
+        std::cerr << "Stream display: couldn't write frame to " << display_name << std::endl;
+        return RD_INPUT_UNAVAILABLE_DISPLAY;
+    }
+    return RD_OK;
+}
@@ -0,0 +1,19 @@
+#ifndef STREAM_DISPLAY_H
+#define STREAM_DISPLAY_H
+
+#if defined (__cplusplus)
+extern "C"
+{
+#endif
+
+	int stream_init_display(void);
+
+	int stream_end_display(void);
+
+	int stream_end_frame(void);
+
+#if defined (__cplusplus)
+}
+#endif
+
+#endif /* STREAM_DISPLAY_H */
@@ -1046,7 +1046,7 @@ int RERay::rd_world_end() {
         }
     }
 
-    return RD_OK;
+    return rd_disp_end_frame(); // Show (or save) the finished frame
 }
 
 int RERay::rd_frame_begin(int frame_no) {